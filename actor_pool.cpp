@@ -0,0 +1,358 @@
+#include "actor_pool.hpp"
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <glog/logging.h>
+
+namespace dqn {
+
+void Actor::Start(const int episodes) {
+  state_ = kAwaitingAction;
+  episodes_left_ = episodes > 0 ? episodes : -1;
+}
+
+void Actor::SetAction(const VecEnv& env, const int id, const Action action) {
+  assert(state_ == kAwaitingAction);
+  past_frames_ = env.input_frames(id);
+  action_ = action;
+  state_ = kAwaitingStep;
+}
+
+bool Actor::Resume(const VecEnv& env, const int id, DQN& dqn,
+                   const bool update) {
+  assert(state_ == kAwaitingStep);
+  if (update) {
+    const auto transition = env.terminal(id) ?
+        Transition(past_frames_, action_, env.reward(id), boost::none) :
+        Transition(past_frames_, action_, env.reward(id),
+                   env.input_frames(id)[kInputFrameCount - 1]);
+    dqn.AddTransition(transition);
+  }
+  state_ = kAwaitingAction;
+  if (!env.terminal(id)) {
+    return false;
+  }
+  if (episodes_left_ > 0 && --episodes_left_ == 0) {
+    state_ = kStopped;
+  }
+  return true;
+}
+
+ActorPool::ActorPool(std::unique_ptr<VecEnv> env,
+                     const int memory_threshold,
+                     const Schedule schedule,
+                     const bool speculative) :
+    memory_threshold_(memory_threshold),
+    schedule_(schedule),
+    speculative_(speculative),
+    env_(std::move(env)),
+    actors_(env_->num_envs()),
+    next_group_(0),
+    pending_updates_(0),
+    graph_(env_->pool()) {
+  for (auto i = 0; i < num_actors(); ++i) {
+    groups_[i % 2].push_back(i);
+  }
+}
+
+void ActorPool::Start(const int episodes_per_actor) {
+  std::vector<int> ids(num_actors());
+  for (auto i = 0; i < num_actors(); ++i) {
+    ids[i] = i;
+    actors_[i].Start(episodes_per_actor);
+  }
+  env_->Reset(ids);
+}
+
+void ActorPool::Stop() {
+  for (auto& actor : actors_) {
+    actor.Stop();
+  }
+}
+
+void ActorPool::Rewind() {
+  Stop();
+  TakeEpisodeScores();
+  env_->Rewind();
+  next_group_ = 0;
+}
+
+int ActorPool::Step(DQN& dqn, const double epsilon, const bool update) {
+  return Step(dqn, std::vector<double>(num_actors(), epsilon), update);
+}
+
+int ActorPool::Step(DQN& dqn, const std::vector<double>& epsilons,
+                    const bool update) {
+  assert(dqn.frame_data_size() == env_->frame_data_size());
+  assert(epsilons.size() == num_actors());
+  if (schedule_ == kTaskGraph) {
+    return StepGraph(dqn, epsilons, update);
+  }
+  if (schedule_ == kSynchronous) {
+    std::vector<int> ids(num_actors());
+    for (auto i = 0; i < num_actors(); ++i) {
+      ids[i] = i;
+    }
+    if (speculative_) {
+      std::vector<int> awaiting;
+      for (const auto i : ids) {
+        if (actors_[i].state() == Actor::kAwaitingAction) {
+          awaiting.push_back(i);
+        }
+      }
+      env_->SpeculateAsync(awaiting);
+    }
+    SelectActions(dqn, epsilons, ids);
+    if (speculative_) {
+      env_->Wait();
+    }
+    std::vector<int> acting;
+    ActionVect actions;
+    for (const auto i : ids) {
+      if (actors_[i].state() == Actor::kAwaitingStep) {
+        acting.push_back(i);
+        actions.push_back(actors_[i].action());
+      }
+    }
+    env_->Step(acting, actions);
+    ResumeActors(dqn, acting, update);
+    if (update) {
+      RunPendingUpdates(dqn);
+    }
+    return acting.size();
+  }
+  // Step one group, falling back to the other if it has no actor left
+  auto group = next_group_;
+  std::vector<int> acting;
+  ActionVect actions;
+  for (auto k = 0; k < 2 && acting.empty(); ++k, group = 1 - group) {
+    SelectActions(dqn, epsilons, groups_[group]);
+    for (const auto i : groups_[group]) {
+      if (actors_[i].state() == Actor::kAwaitingStep) {
+        acting.push_back(i);
+        actions.push_back(actors_[i].action());
+      }
+    }
+  }
+  // group is now the other group
+  next_group_ = group;
+  env_->StepAsync(acting, actions);
+  if (update) {
+    RunPendingUpdates(dqn);
+  }
+  SelectActions(dqn, epsilons, groups_[group]);
+  env_->Wait();
+  ResumeActors(dqn, acting, update);
+  return acting.size();
+}
+
+int ActorPool::StepGraph(DQN& dqn, const std::vector<double>& epsilons,
+                         const bool update) {
+  std::vector<int> ids(num_actors());
+  for (auto i = 0; i < num_actors(); ++i) {
+    ids[i] = i;
+  }
+  // The updates owed by the last call train on two minibatches in turn,
+  // one being gathered while the other trains
+  const auto num_updates = update ? pending_updates_ : 0;
+  if (update) {
+    pending_updates_ = 0;
+  }
+  for (auto& minibatch : minibatches_) {
+    if (num_updates > 0 && !minibatch) {
+      minibatch.reset(new Minibatch());
+    }
+  }
+  std::vector<TaskGraph::Id> samples;
+  std::vector<TaskGraph::Id> gathers;
+  std::vector<TaskGraph::Id> solver_steps;
+  const auto add_sample = [&](const int k) {
+    Minibatch* minibatch = minibatches_[k % 2].get();
+    samples.push_back(graph_.AddMain(
+        "sample", [&dqn, minibatch]() { dqn.SampleMinibatch(*minibatch); },
+        k < 2 ? std::vector<TaskGraph::Id>() :
+        std::vector<TaskGraph::Id>{solver_steps[k - 2]}));
+    gathers.push_back(graph_.AddParallel(
+        "gather", [&dqn, minibatch](int) { dqn.GatherMinibatch(*minibatch); },
+        {0}, {samples.back()}));
+  };
+  // The first minibatches are sampled before the actions are selected, so
+  // they are gathered ahead of the steps of the games
+  for (auto k = 0; k < std::min(num_updates, 2); ++k) {
+    add_sample(k);
+  }
+  const auto select = graph_.AddMain(
+      "select_actions", [&]() { SelectActions(dqn, epsilons, ids); }, {});
+  const auto step = graph_.AddParallel(
+      "env_step", [this](const int i) {
+        if (actors_[i].state() == Actor::kAwaitingStep) {
+          env_->StepOn(i, actors_[i].action());
+        }
+      }, ids, {select});
+  for (auto k = 0; k < num_updates; ++k) {
+    if (k >= 2) {
+      add_sample(k);
+    }
+    Minibatch* minibatch = minibatches_[k % 2].get();
+    const auto sync = graph_.AddMain(
+        "clone_sync", [&dqn]() { dqn.SyncCloneNet(); },
+        k == 0 ? std::vector<TaskGraph::Id>() :
+        std::vector<TaskGraph::Id>{solver_steps[k - 1]});
+    const auto target = graph_.AddMain(
+        "target_forward", [&dqn, minibatch]() {
+          dqn.ComputeTargets(*minibatch);
+        }, {gathers[k], sync});
+    // The actions are selected with the weights of before the updates
+    solver_steps.push_back(graph_.AddMain(
+        "solver_step", [&dqn, minibatch]() { dqn.Train(*minibatch); },
+        {target, select}));
+  }
+  // Replay memory changes once every minibatch is sampled
+  std::vector<int> acting;
+  auto insert_after = samples;
+  insert_after.push_back(step);
+  graph_.AddMain("replay_insert", [&]() {
+    for (const auto i : ids) {
+      if (actors_[i].state() == Actor::kAwaitingStep) {
+        acting.push_back(i);
+      }
+    }
+    ResumeActors(dqn, acting, update);
+  }, insert_after);
+  graph_.Run();
+  env_->CountSteps(acting.size(), graph_.seconds(step));
+  return acting.size();
+}
+
+void ActorPool::SelectActions(DQN& dqn, const std::vector<double>& epsilons,
+                              const std::vector<int>& ids) {
+  std::vector<int> selecting;
+  std::vector<const uint8_t*> frames_batch;
+  std::vector<double> selecting_epsilons;
+  for (const auto i : ids) {
+    if (actors_[i].state() == Actor::kAwaitingAction) {
+      selecting.push_back(i);
+      frames_batch.push_back(env_->frames(i));
+      selecting_epsilons.push_back(epsilons[i]);
+    }
+  }
+  if (selecting.empty()) {
+    return;
+  }
+  const auto actions = dqn.SelectActions(frames_batch, selecting_epsilons);
+  assert(actions.size() == selecting.size());
+  for (auto k = 0; k < selecting.size(); ++k) {
+    actors_[selecting[k]].SetAction(*env_, selecting[k], actions[k]);
+  }
+}
+
+void ActorPool::ResumeActors(DQN& dqn, const std::vector<int>& ids,
+                             const bool update) {
+  for (const auto i : ids) {
+    if (actors_[i].Resume(*env_, i, dqn, update)) {
+      LOG(INFO) << "Actor " << i << " Score " << env_->episode_score(i);
+      episode_scores_.push_back(env_->episode_score(i));
+      episode_actors_.push_back(i);
+    }
+    if (update && dqn.memory_size() > memory_threshold_) {
+      ++pending_updates_;
+    }
+  }
+}
+
+void ActorPool::RunPendingUpdates(DQN& dqn) {
+  for (; pending_updates_ > 0; --pending_updates_) {
+    dqn.Update();
+  }
+}
+
+int ActorPool::FillReplayMemory(DQN& dqn, const int transitions) {
+  const auto missing = transitions - dqn.memory_size();
+  if (missing <= 0) {
+    return 0;
+  }
+  const auto start = std::chrono::steady_clock::now();
+  const auto steps = (missing + num_actors() - 1) / num_actors();
+  for (const auto& transition : env_->PlayRandomly(steps)) {
+    dqn.AddTransition(transition);
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  LOG(INFO) << "Warmed up on " << steps * num_actors()
+            << " random transitions in " << elapsed.count() << " s";
+  return steps * num_actors();
+}
+
+std::vector<double> ActorPool::TakeEpisodeScores() {
+  std::vector<double> scores;
+  scores.swap(episode_scores_);
+  episode_actors_.clear();
+  return scores;
+}
+
+std::vector<double> ActorPool::PlayEpisodes(DQN& dqn, const double epsilon,
+                                            const bool update) {
+  Start(1);
+  while (Step(dqn, epsilon, update) > 0) {}
+  return TakeEpisodeScores();
+}
+
+std::vector<double> ActorPool::PlayEpisodesSequentially(
+    DQN& dqn, const double epsilon, const EvaluationBudget& budget) {
+  assert(budget.max_episodes > 0 || budget.max_seconds > 0 ||
+         budget.max_frames > 0);
+  const auto start = std::chrono::steady_clock::now();
+  Start(0);
+  // The finished episodes of each actor not counted yet. Episodes are
+  // counted in the order they started: the first episode of every actor,
+  // then the second of every actor, and so on. An episode waits for the
+  // longer ones started before it, so short ones are not favored.
+  std::vector<std::deque<double>> finished(num_actors());
+  auto next_actor = 0;
+  std::vector<double> scores;
+  auto mean = 0.0;
+  auto m2 = 0.0; // Sum of squared deviations from the mean
+  long frames = 0;
+  while (true) {
+    frames += Step(dqn, epsilon, false) * env_->frames_per_step();
+    for (auto k = 0; k < episode_scores_.size(); ++k) {
+      finished[episode_actors_[k]].push_back(episode_scores_[k]);
+    }
+    TakeEpisodeScores();
+    while (!finished[next_actor].empty() &&
+           (budget.max_episodes == 0 || scores.size() < budget.max_episodes)) {
+      const auto score = finished[next_actor].front();
+      finished[next_actor].pop_front();
+      next_actor = (next_actor + 1) % num_actors();
+      scores.push_back(score);
+      const auto delta = score - mean;
+      mean += delta / scores.size();
+      m2 += delta * (score - mean);
+    }
+    const int n = scores.size();
+    if (budget.max_episodes > 0 && n >= budget.max_episodes) {
+      break;
+    }
+    if (n >= std::max(budget.min_episodes, 2) && budget.relative_ci > 0 &&
+        1.96 * std::sqrt(m2 / (n - 1) / n) <=
+        budget.relative_ci * std::abs(mean)) {
+      LOG(INFO) << "Confidence interval reached after " << n << " episodes";
+      break;
+    }
+    if (budget.max_frames > 0 && frames >= budget.max_frames) {
+      LOG(INFO) << "Frame budget spent after " << n << " episodes";
+      break;
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (budget.max_seconds > 0 && elapsed.count() >= budget.max_seconds) {
+      LOG(INFO) << "Time budget spent after " << n << " episodes";
+      break;
+    }
+  }
+  Stop();
+  return scores;
+}
+
+}
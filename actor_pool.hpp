@@ -0,0 +1,192 @@
+#ifndef ACTOR_POOL_HPP_
+#define ACTOR_POOL_HPP_
+
+#include <memory>
+#include <vector>
+#include "dqn.hpp"
+#include "task_graph.hpp"
+#include "vec_env.hpp"
+
+namespace dqn {
+
+/**
+ * The episode loop of one actor, written as a resumable state machine.
+ * The loop suspends when it needs an action and is resumed by the pool
+ * once the batched action selection and the environment step are done,
+ * so a single thread interleaves any number of actors.
+ */
+class Actor {
+public:
+  enum State { kStopped, kAwaitingAction, kAwaitingStep };
+
+  Actor() : state_(kStopped), episodes_left_(0) {}
+
+  // Play episodes episodes, or until Stop() if it is 0
+  void Start(const int episodes);
+
+  void Stop() { state_ = kStopped; }
+
+  // Suspend the loop on the action selected for the frames of env
+  void SetAction(const VecEnv& env, const int id, const Action action);
+
+  // Resume the loop after env stepped: record the transition if update is
+  // set and return whether the step ended an episode
+  bool Resume(const VecEnv& env, const int id, DQN& dqn, const bool update);
+
+  State state() const { return state_; }
+
+  Action action() const { return action_; }
+
+protected:
+  State state_;
+  int episodes_left_; // Negative when unlimited
+  InputFrames past_frames_;
+  Action action_;
+};
+
+/**
+ * When to stop a sequential evaluation. Zero disables a limit, but at
+ * least one of max_episodes, max_seconds and max_frames must be set.
+ */
+struct EvaluationBudget {
+  int min_episodes;
+  int max_episodes;
+  // Stop once the 95% confidence interval of the mean score is within
+  // relative_ci * |mean| of it
+  double relative_ci;
+  double max_seconds;
+  long max_frames;
+};
+
+/**
+ * A pool of actors playing on a VecEnv whose emulators live as long as the
+ * pool. Once started, an actor plays episodes back to back: its game is
+ * reset as soon as an episode ends, without waiting for the other actors.
+ * Step() advances all actors by one step and the scores of finished
+ * episodes are collected as they come.
+ */
+class ActorPool {
+public:
+  // How Step() orders action selection, emulation and updates
+  enum Schedule { kSynchronous, kDoubleBuffered, kTaskGraph };
+
+  // One actor plays on each environment of env
+  ActorPool(std::unique_ptr<VecEnv> env,
+            const int memory_threshold,
+            const Schedule schedule,
+            const bool speculative);
+
+  // Start every actor on a new game. Each actor plays episodes_per_actor
+  // episodes, or keeps playing until Stop() if it is 0.
+  void Start(const int episodes_per_actor);
+
+  // Stop the actors, abandoning their unfinished games
+  void Stop();
+
+  // Stop the actors and bring the pool and its games back to the state
+  // they were created in (see VecEnv::Rewind), so that the next Start()
+  // plays the same games for the same actions
+  void Rewind();
+
+  // Advance every playing actor by one step, selecting actions with
+  // epsilon. If update is set, the transitions are added to replay memory
+  // and dqn is updated once the memory holds more than memory_threshold
+  // transitions. Returns the number of actors that took a step.
+  //
+  // When double buffered, the actors are split in two groups and each
+  // call steps only one of them. While its emulators run, the actions of
+  // the other group are selected and the updates owed by the previous
+  // call are run, so emulation and the net overlap.
+  //
+  // With the task graph schedule, each call is a graph of tasks run on
+  // the workers of env: action selection, the steps of the games, replay
+  // inserts and, for each update owed by the previous call, sampling,
+  // gathering the minibatch, clone sync, target forward and solver step.
+  // The games step and the minibatches are gathered on the workers while
+  // the main thread runs the nets.
+  //
+  // When speculative, and synchronous, the games are stepped with
+  // the previous actions while the net selects the new ones. The steps
+  // whose action is selected again are kept and the others are redone.
+  int Step(DQN& dqn, const double epsilon, const bool update);
+
+  // Same as above with one epsilon per actor
+  int Step(DQN& dqn, const std::vector<double>& epsilons, const bool update);
+
+  // Fill the replay memory of dqn with uniformly random transitions until
+  // it holds at least transitions of them, without the net and with every
+  // game played on its own for many steps between synchronizations. The
+  // actors must have been started, and keep playing the same games after.
+  // Returns the number of steps taken.
+  int FillReplayMemory(DQN& dqn, const int transitions);
+
+  // Remove and return the scores of the episodes finished since last call
+  std::vector<double> TakeEpisodeScores();
+
+  // Play one episode on every actor and return their scores
+  std::vector<double> PlayEpisodes(DQN& dqn, const double epsilon,
+                                   const bool update);
+
+  // Frames emulated per second of stepping since the last call
+  double TakeFramesPerSecond() { return env_->TakeFramesPerSecond(); }
+
+  // Calls and time of the tasks of the task graph since the last call
+  std::string TakeTaskProfile() { return graph_.TakeProfile(); }
+
+  // Fraction of the speculative steps kept since the last call
+  double TakeSpeculationHitRate() { return env_->TakeSpeculationHitRate(); }
+
+  // End episodes after max_episode_frames frames. 0 removes the cap.
+  void set_max_episode_frames(const int max_episode_frames) {
+    env_->set_max_episode_frames(max_episode_frames);
+  }
+
+  // Play episodes back to back on every actor, streaming their scores
+  // into a running mean and variance, until budget says to stop. Scores
+  // are counted in the order the episodes started, round by round over
+  // the actors, so the count only grows when the oldest uncounted episode
+  // ends. Otherwise the short episodes, of which an actor plays more in
+  // the same time, would dominate. Only the time and frame budgets can cut
+  // a long episode short. Returns the counted scores.
+  std::vector<double> PlayEpisodesSequentially(DQN& dqn,
+                                               const double epsilon,
+                                               const EvaluationBudget& budget);
+
+  VecEnv& env() { return *env_; }
+
+  int num_actors() const { return env_->num_envs(); }
+
+protected:
+  // Select the actions of the given actors that await one
+  void SelectActions(DQN& dqn, const std::vector<double>& epsilons,
+                     const std::vector<int>& ids);
+
+  // Resume the actors after their environment step and count the updates
+  // they owe dqn
+  void ResumeActors(DQN& dqn, const std::vector<int>& ids, const bool update);
+
+  // Run the updates counted by ResumeActors
+  void RunPendingUpdates(DQN& dqn);
+
+  // Step() with the task graph schedule
+  int StepGraph(DQN& dqn, const std::vector<double>& epsilons,
+                const bool update);
+
+protected:
+  const int memory_threshold_;
+  const Schedule schedule_;
+  const bool speculative_;
+  std::unique_ptr<VecEnv> env_;
+  std::vector<Actor> actors_;
+  std::vector<double> episode_scores_;
+  std::vector<int> episode_actors_; // The actor of each episode score
+  std::vector<int> groups_[2];
+  int next_group_; // Group stepped by the next double-buffered Step()
+  int pending_updates_; // Updates owed to dqn by the last Step()
+  TaskGraph graph_;
+  std::unique_ptr<Minibatch> minibatches_[2]; // Gathered while one trains
+};
+
+}
+
+#endif /* ACTOR_POOL_HPP_ */
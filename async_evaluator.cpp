@@ -0,0 +1,99 @@
+#include "async_evaluator.hpp"
+#include <cmath>
+#include <limits>
+#include <glog/logging.h>
+#include "cpu_budget.hpp"
+
+namespace dqn {
+
+double ReportEvaluation(const std::vector<double>& scores) {
+  if (scores.empty()) {
+    LOG(WARNING) << "No evaluation episode finished";
+    return 0.0;
+  }
+  double total_score = 0.0;
+  for (auto score : scores) {
+    total_score += score;
+  }
+  const auto avg_score = total_score / static_cast<double>(scores.size());
+  double stddev = 0.0; // Compute the sample standard deviation
+  for (auto i=0; i<scores.size(); ++i) {
+    stddev += (scores[i] - avg_score) * (scores[i] - avg_score);
+  }
+  if (scores.size() > 1) {
+    stddev = sqrt(stddev / static_cast<double>(scores.size() - 1));
+  }
+  LOG(INFO) << "Evaluation avg_score = " << avg_score << " std = " << stddev;
+  return avg_score;
+}
+
+AsyncEvaluator::AsyncEvaluator(DQN& frozen,
+                               const std::function<double(DQN&)>& evaluate,
+                               const std::string& snapshot_prefix) :
+    frozen_(frozen),
+    evaluate_(evaluate),
+    snapshot_prefix_(snapshot_prefix),
+    caffe_mode_(caffe::Caffe::mode()),
+    best_score_(std::numeric_limits<double>::lowest()),
+    iteration_(0),
+    pending_(false),
+    stopping_(false) {
+  thread_ = std::thread(&AsyncEvaluator::Run, this);
+  NameThread(thread_.native_handle(), "dqn_evaluator");
+}
+
+AsyncEvaluator::~AsyncEvaluator() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  evaluation_requested_.notify_one();
+  thread_.join();
+}
+
+void AsyncEvaluator::Evaluate(const DQN& dqn) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  evaluation_done_.wait(lock, [&]{ return !pending_; });
+  dqn.ExportWeights(weights_);
+  iteration_ = dqn.current_iteration();
+  pending_ = true;
+  evaluation_requested_.notify_one();
+}
+
+void AsyncEvaluator::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  evaluation_done_.wait(lock, [&]{ return !pending_; });
+}
+
+void AsyncEvaluator::Run() {
+  caffe::Caffe::set_mode(caffe_mode_);
+  while (true) {
+    int iteration;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      evaluation_requested_.wait(lock, [&]{ return stopping_ || pending_; });
+      if (stopping_) {
+        return;
+      }
+      // weights_ is not written again until pending_ is cleared
+      frozen_.ImportWeights(weights_);
+      iteration = iteration_;
+    }
+    LOG(INFO) << "Evaluating the weights of iter " << iteration;
+    const auto avg_score = evaluate_(frozen_);
+    if (avg_score > best_score_) {
+      LOG(INFO) << "iter " << iteration << " New High Score: " << avg_score;
+      best_score_ = avg_score;
+      const auto model_file =
+          snapshot_prefix_ + "_iter_" + std::to_string(iteration) +
+          ".caffemodel";
+      LOG(INFO) << "Snapshotting to " << model_file;
+      caffe::WriteProtoToBinaryFile(weights_, model_file);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ = false;
+    evaluation_done_.notify_all();
+  }
+}
+
+}
@@ -0,0 +1,65 @@
+#ifndef ASYNC_EVALUATOR_HPP_
+#define ASYNC_EVALUATOR_HPP_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <caffe/caffe.hpp>
+#include "dqn.hpp"
+
+namespace dqn {
+
+/**
+ * Log the average and standard deviation of evaluation scores and return
+ * the average, or 0 if there are none
+ */
+double ReportEvaluation(const std::vector<double>& scores);
+
+/**
+ * Evaluates frozen copies of a DQN on its own thread while training goes
+ * on. Each evaluation runs evaluate, which should play on emulators of its
+ * own, with the weights the DQN had when Evaluate() was called. When the
+ * average score it returns is a new high, those weights are written to
+ * <snapshot_prefix>_iter_<iteration>.caffemodel.
+ */
+class AsyncEvaluator {
+public:
+  // frozen is used only by the evaluation thread
+  AsyncEvaluator(DQN& frozen,
+                 const std::function<double(DQN&)>& evaluate,
+                 const std::string& snapshot_prefix);
+
+  ~AsyncEvaluator();
+
+  // Start evaluating the current weights of dqn and return right away. If
+  // the previous evaluation is still running, wait for it first.
+  void Evaluate(const DQN& dqn);
+
+  // Wait until the last evaluation is done
+  void Wait();
+
+protected:
+  // Main method of the evaluation thread
+  void Run();
+
+protected:
+  DQN& frozen_;
+  const std::function<double(DQN&)> evaluate_;
+  const std::string snapshot_prefix_;
+  const caffe::Caffe::Brew caffe_mode_; // Caffe modes are per thread
+  double best_score_;
+  std::thread thread_;
+  std::mutex mutex_; // Guards the members below
+  std::condition_variable evaluation_requested_;
+  std::condition_variable evaluation_done_;
+  caffe::NetParameter weights_;
+  int iteration_; // Iteration of weights_
+  bool pending_;
+  bool stopping_;
+};
+
+}
+
+#endif /* ASYNC_EVALUATOR_HPP_ */
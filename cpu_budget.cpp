@@ -0,0 +1,164 @@
+#include "cpu_budget.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <sched.h>
+#include <unistd.h>
+#include <glog/logging.h>
+
+namespace dqn {
+
+namespace {
+
+cpu_set_t MakeCpuSet(const std::vector<int>& cpus) {
+  assert(!cpus.empty());
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const auto cpu : cpus) {
+    CHECK(cpu >= 0 && cpu < CPU_SETSIZE) << "Invalid CPU " << cpu;
+    CPU_SET(cpu, &set);
+  }
+  return set;
+}
+
+std::vector<pid_t> ProcessThreads() {
+  std::vector<pid_t> tids;
+  const auto dir = opendir("/proc/self/task");
+  if (!dir) {
+    return tids;
+  }
+  while (const auto entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      tids.push_back(std::stoi(entry->d_name));
+    }
+  }
+  closedir(dir);
+  std::sort(tids.begin(), tids.end());
+  return tids;
+}
+
+}
+
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::istringstream ranges(list);
+  for (std::string range; std::getline(ranges, range, ','); ) {
+    const auto dash = range.find('-');
+    const auto first = std::stoi(range.substr(0, dash));
+    const auto last = dash == std::string::npos ?
+        first : std::stoi(range.substr(dash + 1));
+    CHECK(first <= last) << "Invalid CPU range " << range;
+    for (auto cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  CHECK(!cpus.empty()) << "Empty CPU list";
+  return cpus;
+}
+
+std::vector<int> AllowedCpus() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  PCHECK(sched_getaffinity(0, sizeof(set), &set) == 0)
+      << "Cannot get the CPUs of the thread";
+  std::vector<int> cpus;
+  for (auto cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+void PinThread(const pthread_t thread, const std::vector<int>& cpus) {
+  const auto set = MakeCpuSet(cpus);
+  const auto error = pthread_setaffinity_np(thread, sizeof(set), &set);
+  LOG_IF(WARNING, error != 0) << "Cannot pin a thread: " << strerror(error);
+}
+
+void PinProcess(const std::vector<int>& cpus) {
+  const auto set = MakeCpuSet(cpus);
+  for (const auto tid : ProcessThreads()) {
+    PLOG_IF(WARNING, sched_setaffinity(tid, sizeof(set), &set) != 0)
+        << "Cannot pin thread " << tid;
+  }
+}
+
+void NameThread(const pthread_t thread, const std::string& name) {
+  pthread_setname_np(thread, name.substr(0, 15).c_str());
+}
+
+bool SetBlasThreads(const int num_threads) {
+  assert(num_threads > 0);
+  // Caffe is linked with any of these libraries, so look them up by name
+  for (const auto symbol : {"openblas_set_num_threads",
+                            "MKL_Set_Num_Threads",
+                            "omp_set_num_threads"}) {
+    const auto set_num_threads = reinterpret_cast<void (*)(int)>(
+        dlsym(RTLD_DEFAULT, symbol));
+    if (set_num_threads) {
+      set_num_threads(num_threads);
+      LOG(INFO) << "BLAS threads set to " << num_threads << " by " << symbol;
+      return true;
+    }
+  }
+  LOG(WARNING) << "Cannot set the number of BLAS threads";
+  return false;
+}
+
+CpuUsageReport::CpuUsageReport() :
+    last_time_(std::chrono::steady_clock::now()) {
+  Take();
+}
+
+std::string CpuUsageReport::Take() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto now = std::chrono::steady_clock::now();
+  const auto elapsed =
+      std::chrono::duration<double>(now - last_time_).count();
+  last_time_ = now;
+  const auto ticks_per_second = static_cast<double>(sysconf(_SC_CLK_TCK));
+  std::ostringstream report;
+  report << "CPU usage of the last " << elapsed << " s:";
+  std::map<pid_t, double> seconds;
+  for (const auto tid : ProcessThreads()) {
+    std::ifstream stat("/proc/self/task/" + std::to_string(tid) + "/stat");
+    std::string line;
+    if (!std::getline(stat, line)) {
+      continue; // The thread exited
+    }
+    // The name is in parentheses and may hold spaces; the fields after
+    // it start with the state, the third field
+    const auto name_begin = line.find('(') + 1;
+    const auto name_end = line.rfind(')');
+    const auto name = line.substr(name_begin, name_end - name_begin);
+    std::istringstream fields(line.substr(name_end + 2));
+    std::vector<std::string> values;
+    for (std::string value; fields >> value; ) {
+      values.push_back(value);
+    }
+    if (values.size() < 37) {
+      continue;
+    }
+    const auto utime = std::stod(values[11]); // Field 14
+    const auto stime = std::stod(values[12]); // Field 15
+    const auto cpu = values[36]; // Field 39
+    seconds[tid] = (utime + stime) / ticks_per_second;
+    const auto last = last_seconds_.find(tid);
+    const auto used = seconds[tid] -
+        (last != last_seconds_.end() ? last->second : 0.0);
+    report << "\n  " << std::setw(7) << tid << " " << std::setw(15) << name
+           << std::setw(7) << std::fixed << std::setprecision(1)
+           << (elapsed > 0 ? 100 * used / elapsed : 0.0) << "% on CPU "
+           << cpu << (tid == getpid() ? " (main thread)" : "");
+  }
+  last_seconds_.swap(seconds);
+  return report.str();
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef CPU_BUDGET_HPP_
+#define CPU_BUDGET_HPP_
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+
+namespace dqn {
+
+/**
+ * Parse a list of CPUs such as "0-3,8"
+ */
+std::vector<int> ParseCpuList(const std::string& list);
+
+/**
+ * The CPUs the calling thread may run on
+ */
+std::vector<int> AllowedCpus();
+
+/**
+ * Restrict a thread to the given CPUs
+ */
+void PinThread(const pthread_t thread, const std::vector<int>& cpus);
+
+/**
+ * Restrict every thread of the process started so far to the given CPUs,
+ * including the threads a BLAS library starts when it is loaded. Threads
+ * started later inherit the CPUs of the thread starting them.
+ */
+void PinProcess(const std::vector<int>& cpus);
+
+/**
+ * Name a thread in the CPU usage report, ps and top. Names are cut to 15
+ * characters.
+ */
+void NameThread(const pthread_t thread, const std::string& name);
+
+/**
+ * Set the number of threads of the BLAS library Caffe was linked with, if
+ * it is OpenBLAS, MKL or an OpenMP one. Returns whether one was found.
+ */
+bool SetBlasThreads(const int num_threads);
+
+/**
+ * Reports the CPU usage of every thread of the process, read from /proc
+ */
+class CpuUsageReport {
+public:
+  CpuUsageReport();
+
+  // The CPU time of each thread since the last call, as a percentage of
+  // the elapsed time, and the CPU it last ran on. May be called by several
+  // threads.
+  std::string Take();
+
+protected:
+  std::mutex mutex_; // Guards the members below
+  std::map<pid_t, double> last_seconds_; // CPU seconds of each thread
+  std::chrono::steady_clock::time_point last_time_;
+};
+
+}
+
+#endif /* CPU_BUDGET_HPP_ */
@@ -7,9 +7,15 @@
 #include <boost/algorithm/string.hpp>
 #include <glog/logging.h>
 #include "prettyprint.hpp"
+#include "dqn_static_net.hpp"
 
 namespace dqn {
 
+static_assert(static_net::kInputSize == kInputDataSize,
+              "dqn_static_net.hpp does not match the input size");
+static_assert(static_net::kOutputSize == kOutputCount,
+              "dqn_static_net.hpp does not match the output count");
+
 /**
  * Convert pixel_t (NTSC) to RGB values.
  * Each value range [0,255]
@@ -72,12 +78,20 @@ uint8_t PixelToGrayscale(const pixel_t pixel) {
   return RGBToGrayscale(PixelToRGB(pixel));
 }
 
+FrameDataSp MakeFrameData(const int size) {
+  if (size == kCroppedFrameDataSize) {
+    return std::make_shared<FixedSizeFrameData<kCroppedFrameDataSize>>();
+  }
+  CHECK_EQ(size, kRamSize) << "Unsupported frame size";
+  return std::make_shared<FixedSizeFrameData<kRamSize>>();
+}
+
 FrameDataSp PreprocessScreen(const ALEScreen& raw_screen) {
   const int raw_screen_width = raw_screen.width();
   const int raw_screen_height = raw_screen.height();
   assert(raw_screen_height > raw_screen_width);
   const auto raw_pixels = raw_screen.getArray();
-  auto screen = std::make_shared<FrameData>();
+  auto screen = MakeFrameData(kCroppedFrameDataSize);
   // Crop the top of the screen
   const int cropped_screen_height = static_cast<int>(.85 * raw_screen_height);
   const int start_y = raw_screen_height - cropped_screen_height;
@@ -127,6 +141,26 @@ FrameDataSp PreprocessScreen(const ALEScreen& raw_screen) {
   return screen;
 }
 
+FrameDataSp ObserveRam(const ALERAM& ram) {
+  assert(ram.size() == kRamSize);
+  auto frame = MakeFrameData(kRamSize);
+  std::copy(ram.array(), ram.array() + ram.size(), frame->begin());
+  return frame;
+}
+
+FrameDataSp Observe(ALEInterface& ale, const bool ram) {
+  return ram ? ObserveRam(ale.getRAM()) : PreprocessScreen(ale.getScreen());
+}
+
+void InitializeALE(ALEInterface& ale, const bool display_screen,
+                   const std::string& rom, const int frame_skip) {
+  assert(frame_skip >= 1);
+  ale.set("display_screen", display_screen);
+  ale.set("disable_color_averaging", true);
+  ale.set("frame_skip", frame_skip);
+  ale.loadROM(rom);
+}
+
 std::string PrintQValues(
     const std::vector<float>& q_values, const ActionVect& actions) {
   assert(!q_values.empty());
@@ -167,6 +201,10 @@ void DQN::LoadTrainedModel(const std::string& model_bin) {
   net_->CopyTrainedLayersFrom(model_bin);
 }
 
+void DQN::LoadStudentModel(const std::string& model_bin) {
+  student_net_->CopyTrainedLayersFrom(model_bin);
+}
+
 void DQN::RestoreSolver(const std::string& solver_bin) {
   solver_->Restore(solver_bin.c_str());
 }
@@ -177,8 +215,13 @@ void DQN::Initialize() {
   solver_->PreSolve();
   net_ = solver_->net();
   std::fill(dummy_input_data_.begin(), dummy_input_data_.end(), 0.0);
-  assert(HasBlobSize(*net_->blob_by_name("frames"), kMinibatchSize,
-                     kInputFrameCount, kCroppedFrameSize, kCroppedFrameSize));
+  const auto frames_blob = net_->blob_by_name("frames");
+  CHECK(HasBlobSize(*frames_blob, kMinibatchSize, kInputFrameCount,
+                    kCroppedFrameSize, kCroppedFrameSize) ||
+        HasBlobSize(*frames_blob, kMinibatchSize, kInputFrameCount,
+                    1, kRamSize))
+      << "frames must be a stack of screens or of RAM snapshots";
+  frame_data_size_ = frames_blob->height() * frames_blob->width();
   assert(HasBlobSize(*net_->blob_by_name("target"), kMinibatchSize,
                      kOutputCount, 1, 1));
   assert(HasBlobSize(*net_->blob_by_name("filter"), kMinibatchSize,
@@ -186,64 +229,207 @@ void DQN::Initialize() {
   ClonePrimaryNet();
 }
 
+void DQN::InitializeStudent(
+    const caffe::SolverParameter& student_solver_param,
+    const int distill_freq) {
+  assert(distill_freq >= 0);
+  student_solver_.reset(caffe::GetSolver<float>(student_solver_param));
+  student_solver_->PreSolve();
+  student_net_ = student_solver_->net();
+  distill_freq_ = distill_freq;
+  const auto frames_blob = net_->blob_by_name("frames");
+  assert(HasBlobSize(*student_net_->blob_by_name("frames"), kMinibatchSize,
+                     kInputFrameCount, frames_blob->height(),
+                     frames_blob->width()));
+  assert(HasBlobSize(*student_net_->blob_by_name("target"), kMinibatchSize,
+                     kOutputCount, 1, 1));
+  assert(HasBlobSize(*student_net_->blob_by_name("filter"), kMinibatchSize,
+                     kOutputCount, 1, 1));
+}
+
+void DQN::EnableStaticForward() {
+  CHECK(HasBlobSize(*net_->blob_by_name("frames"), kMinibatchSize,
+                    static_net::kInputChannels, static_net::kInputHeight,
+                    static_net::kInputWidth))
+      << "The static network was generated for another input shape";
+  // Compare both networks on a batch of random frames
+  FramesLayerInputData frames_input;
+  std::uniform_int_distribution<int> pixel(0, 255);
+  for (auto& v : frames_input) {
+    v = pixel(random_engine);
+  }
+  InputDataIntoLayers(*net_, frames_input, dummy_input_data_,
+                      dummy_input_data_);
+  net_->ForwardPrefilled(nullptr);
+  const auto caffe_q_values = net_->blob_by_name("q_values")->cpu_data();
+  std::array<float, kMinibatchSize * kOutputCount> static_q_values;
+  StaticForward(frames_input, kMinibatchSize, static_q_values.data());
+  for (auto i = 0; i < static_q_values.size(); ++i) {
+    const auto tolerance = 1e-3 * std::max(1.0f, std::abs(caffe_q_values[i]));
+    CHECK(std::abs(static_q_values[i] - caffe_q_values[i]) <= tolerance)
+        << "Static network disagrees with Caffe: " << static_q_values[i]
+        << " vs " << caffe_q_values[i];
+  }
+  static_forward_ = true;
+}
+
+void DQN::StaticForward(const FramesLayerInputData& frames_input,
+                        const int batch_size, float* q_values) {
+  static_net::Params params;
+  for (auto i = 0; i < static_net::kParamCount; ++i) {
+    const auto layer = net_->layer_by_name(static_net::kParamLayers[i]);
+    assert(layer);
+    params[i] = layer->blobs()[i % 2]->cpu_data();
+  }
+  static_net::Workspace workspace;
+  for (auto i = 0; i < batch_size; ++i) {
+    static_net::Forward(frames_input.data() + i * kInputDataSize, params,
+                        &workspace, q_values + i * kOutputCount);
+  }
+}
+
 Action DQN::SelectAction(const InputFrames& last_frames, const double epsilon) {
   return SelectActions(std::vector<InputFrames>{{last_frames}}, epsilon)[0];
 }
 
 ActionVect DQN::SelectActions(const std::vector<InputFrames>& frames_batch,
                               const double epsilon) {
-  assert(epsilon >= 0.0 && epsilon <= 1.0);
-  assert(frames_batch.size() <= kMinibatchSize);
+  return SelectActionsPerElement(
+      frames_batch, std::vector<double>(frames_batch.size(), epsilon));
+}
+
+ActionVect DQN::SelectActions(const std::vector<const uint8_t*>& frames_batch,
+                              const double epsilon) {
+  return SelectActionsPerElement(
+      frames_batch, std::vector<double>(frames_batch.size(), epsilon));
+}
+
+ActionVect DQN::SelectActions(const std::vector<InputFrames>& frames_batch,
+                              const std::vector<double>& epsilons) {
+  return SelectActionsPerElement(frames_batch, epsilons);
+}
+
+ActionVect DQN::SelectActions(const std::vector<const uint8_t*>& frames_batch,
+                              const std::vector<double>& epsilons) {
+  return SelectActionsPerElement(frames_batch, epsilons);
+}
+
+template <typename Frames>
+ActionVect DQN::SelectActionsPerElement(const std::vector<Frames>& frames_batch,
+                                        const std::vector<double>& epsilons) {
+  assert(frames_batch.size() == epsilons.size());
   ActionVect actions(frames_batch.size());
-  if (std::uniform_real_distribution<>(0.0, 1.0)(random_engine) < epsilon) {
-    // Select randomly
-    for (int i=0; i<actions.size(); ++i) {
-      const auto random_idx = std::uniform_int_distribution<int>
-          (0, legal_actions_.size() - 1)(random_engine);
-      actions[i] = legal_actions_[random_idx];
-    }
-  } else {
-    // Select greedily
-    std::vector<ActionValue> q = SelectActionGreedily(*net_, frames_batch);
-    assert(q.size() == actions.size());
-    for (int i=0; i<actions.size(); ++i) {
-      actions[i] = q[i].first;
+  std::vector<int> greedy_rows;
+  std::vector<Frames> greedy_frames;
+  for (auto i = 0; i < frames_batch.size(); ++i) {
+    assert(epsilons[i] >= 0.0 && epsilons[i] <= 1.0);
+    if (std::uniform_real_distribution<>(0.0, 1.0)(random_engine) >=
+        epsilons[i]) {
+      greedy_rows.push_back(i);
+      greedy_frames.push_back(frames_batch[i]);
+    } else {
+      actions[i] = SelectRandomAction();
     }
   }
+  if (greedy_rows.empty()) {
+    return actions;
+  }
+  // Packing only saves whole minibatches: Caffe forwards the padding rows
+  const auto action_values = SelectActionGreedily(
+      act_with_student_ ? *student_net_ : *net_, greedy_frames);
+  for (auto k = 0; k < greedy_rows.size(); ++k) {
+    actions[greedy_rows[k]] = action_values[k].first;
+  }
   return actions;
 }
 
+Action DQN::SelectRandomAction() {
+  const auto random_idx = std::uniform_int_distribution<int>
+      (0, legal_actions_.size() - 1)(random_engine);
+  return legal_actions_[random_idx];
+}
+
 ActionValue DQN::SelectActionGreedily(caffe::Net<float>& net,
                                       const InputFrames& last_frames) {
   return SelectActionGreedily(
       net, std::vector<InputFrames>{{last_frames}}).front();
 }
 
+void CopyInputFrames(const InputFrames& input_frames, const int row,
+                     FramesLayerInputData& frames_input) {
+  for (auto j = 0; j < kInputFrameCount; ++j) {
+    const auto& frame_data = input_frames[j];
+    std::copy(frame_data->begin(), frame_data->end(), frames_input.begin() +
+              (row * kInputFrameCount + j) * frame_data->size());
+  }
+}
+
 std::vector<ActionValue> DQN::SelectActionGreedily(
     caffe::Net<float>& net,
     const std::vector<InputFrames>& last_frames_batch) {
-  assert(last_frames_batch.size() <= kMinibatchSize);
-  std::array<float, kMinibatchDataSize> frames_input;
-  // Input frames to the net and compute Q values for each legal actions
-  for (auto i = 0; i < last_frames_batch.size(); ++i) {
-    for (auto j = 0; j < kInputFrameCount; ++j) {
-      const auto& frame_data = last_frames_batch[i][j];
-      std::copy(frame_data->begin(),
-                frame_data->end(),
-                frames_input.begin() + i * kInputDataSize +
-                j * kCroppedFrameDataSize);
+  // Forward larger batches in chunks of the net's batch size
+  std::vector<ActionValue> results;
+  results.reserve(last_frames_batch.size());
+  FramesLayerInputData frames_input;
+  for (auto begin = 0; begin < last_frames_batch.size();
+       begin += kMinibatchSize) {
+    const auto end = std::min<int>(begin + kMinibatchSize,
+                                   last_frames_batch.size());
+    for (auto i = begin; i < end; ++i) {
+      CopyInputFrames(last_frames_batch[i], i - begin, frames_input);
+    }
+    const auto chunk_results =
+        SelectActionGreedily(net, frames_input, end - begin);
+    results.insert(results.end(), chunk_results.begin(), chunk_results.end());
+  }
+  return results;
+}
+
+std::vector<ActionValue> DQN::SelectActionGreedily(
+    caffe::Net<float>& net,
+    const std::vector<const uint8_t*>& frames_batch) {
+  const auto input_data_size = kInputFrameCount * frame_data_size_;
+  std::vector<ActionValue> results;
+  results.reserve(frames_batch.size());
+  FramesLayerInputData frames_input;
+  for (auto begin = 0; begin < frames_batch.size(); begin += kMinibatchSize) {
+    const auto end = std::min<int>(begin + kMinibatchSize,
+                                   frames_batch.size());
+    // The stacked frames of each input are contiguous: one copy per input
+    for (auto i = begin; i < end; ++i) {
+      std::copy(frames_batch[i], frames_batch[i] + input_data_size,
+                frames_input.begin() + (i - begin) * input_data_size);
     }
+    const auto chunk_results =
+        SelectActionGreedily(net, frames_input, end - begin);
+    results.insert(results.end(), chunk_results.begin(), chunk_results.end());
+  }
+  return results;
+}
+
+std::vector<ActionValue> DQN::SelectActionGreedily(
+    caffe::Net<float>& net,
+    const FramesLayerInputData& frames_input,
+    const int batch_size) {
+  assert(batch_size <= kMinibatchSize);
+  const float* q_values_data;
+  std::array<float, kMinibatchSize * kOutputCount> static_q_values;
+  if (static_forward_ && &net == net_.get()) {
+    StaticForward(frames_input, batch_size, static_q_values.data());
+    q_values_data = static_q_values.data();
+  } else {
+    InputDataIntoLayers(net, frames_input, dummy_input_data_,
+                        dummy_input_data_);
+    net.ForwardPrefilled(nullptr);
+    q_values_data = net.blob_by_name("q_values")->cpu_data();
   }
-  InputDataIntoLayers(net, frames_input, dummy_input_data_, dummy_input_data_);
-  net.ForwardPrefilled(nullptr);
   // Collect the Results
   std::vector<ActionValue> results;
-  results.reserve(last_frames_batch.size());
-  const auto q_values_blob = net.blob_by_name("q_values");
-  for (auto i = 0; i < last_frames_batch.size(); ++i) {
+  results.reserve(batch_size);
+  for (auto i = 0; i < batch_size; ++i) {
     // Get the Q values from the net
     const auto action_evaluator = [&](Action action) {
-      const auto q = q_values_blob->data_at(i, static_cast<int>(action), 0, 0);
+      const auto q = q_values_data[i * kOutputCount + static_cast<int>(action)];
       assert(!std::isnan(q));
       return q;
     };
@@ -267,48 +453,62 @@ void DQN::AddTransition(const Transition& transition) {
 }
 
 void DQN::Update() {
+  SyncCloneNet();
+  if (!minibatch_) {
+    minibatch_.reset(new Minibatch());
+  }
+  SampleMinibatch(*minibatch_);
+  GatherMinibatch(*minibatch_);
+  ComputeTargets(*minibatch_);
+  Train(*minibatch_);
+}
+
+void DQN::SyncCloneNet() {
   // Every clone_iters steps, update the clone_net_ to equal the primary net
   if (current_iteration() % clone_frequency_ == 0) {
     LOG(INFO) << "Iter " << current_iteration() << ": Updating Clone Net";
     ClonePrimaryNet();
   }
+}
 
-  // Sample transitions from replay memory
-  std::vector<int> transitions;
-  transitions.reserve(kMinibatchSize);
-  for (auto i = 0; i < kMinibatchSize; ++i) {
-    const auto random_transition_idx =
-        std::uniform_int_distribution<int>(0, replay_memory_.size() - 1)(
-            random_engine);
-    transitions.push_back(random_transition_idx);
+void DQN::SampleMinibatch(Minibatch& minibatch) {
+  minibatch.transitions.clear();
+  for (const auto idx : SampleTransitions()) {
+    minibatch.transitions.push_back(replay_memory_[idx]);
   }
-  // Compute target values: max_a Q(s',a)
-  std::vector<InputFrames> target_last_frames_batch;
-  for (const auto idx : transitions) {
-    const auto& transition = replay_memory_[idx];
+}
+
+void DQN::GatherMinibatch(Minibatch& minibatch) const {
+  assert(minibatch.transitions.size() == kMinibatchSize);
+  minibatch.target_last_frames.clear();
+  for (auto i = 0; i < kMinibatchSize; ++i) {
+    const auto& transition = minibatch.transitions[i];
+    CopyInputFrames(std::get<0>(transition), i, minibatch.frames_input);
     if (!std::get<3>(transition)) {
       // This is a terminal state
       continue;
     }
     // Compute target value
     InputFrames target_last_frames;
-    for (auto i = 0; i < kInputFrameCount - 1; ++i) {
-      target_last_frames[i] = std::get<0>(transition)[i + 1];
+    for (auto j = 0; j < kInputFrameCount - 1; ++j) {
+      target_last_frames[j] = std::get<0>(transition)[j + 1];
     }
     target_last_frames[kInputFrameCount - 1] = std::get<3>(transition).get();
-    target_last_frames_batch.push_back(target_last_frames);
+    minibatch.target_last_frames.push_back(target_last_frames);
   }
+}
+
+void DQN::ComputeTargets(Minibatch& minibatch) {
   // Get the update targets from the cloned network
   const auto actions_and_values =
-      SelectActionGreedily(*clone_net_, target_last_frames_batch);
-  FramesLayerInputData frames_input;
-  TargetLayerInputData target_input;
-  FilterLayerInputData filter_input;
+      SelectActionGreedily(*clone_net_, minibatch.target_last_frames);
+  auto& target_input = minibatch.target_input;
+  auto& filter_input = minibatch.filter_input;
   std::fill(target_input.begin(), target_input.end(), 0.0f);
   std::fill(filter_input.begin(), filter_input.end(), 0.0f);
   auto target_value_idx = 0;
   for (auto i = 0; i < kMinibatchSize; ++i) {
-    const auto& transition = replay_memory_[transitions[i]];
+    const auto& transition = minibatch.transitions[i];
     const auto action = std::get<1>(transition);
     assert(static_cast<int>(action) < kOutputCount);
     const auto reward = std::get<2>(transition);
@@ -320,14 +520,79 @@ void DQN::Update() {
     target_input[i * kOutputCount + static_cast<int>(action)] = target;
     filter_input[i * kOutputCount + static_cast<int>(action)] = 1;
     VLOG(1) << "filter:" << action_to_string(action) << " target:" << target;
-    for (auto j = 0; j < kInputFrameCount; ++j) {
-      const auto& frame_data = std::get<0>(transition)[j];
-      std::copy(frame_data->begin(), frame_data->end(), frames_input.begin() +
-                i * kInputDataSize + j * kCroppedFrameDataSize);
-    }
   }
-  InputDataIntoLayers(*net_, frames_input, target_input, filter_input);
+}
+
+void DQN::Train(const Minibatch& minibatch) {
+  InputDataIntoLayers(*net_, minibatch.frames_input, minibatch.target_input,
+                      minibatch.filter_input);
   solver_->Step(1);
+  if (student_solver_ && distill_freq_ > 0 &&
+      current_iteration() % distill_freq_ == 0) {
+    UpdateStudent();
+  }
+}
+
+std::vector<int> DQN::SampleTransitions() {
+  assert(!replay_memory_.empty());
+  std::vector<int> transitions;
+  transitions.reserve(kMinibatchSize);
+  for (auto i = 0; i < kMinibatchSize; ++i) {
+    const auto random_transition_idx =
+        std::uniform_int_distribution<int>(0, replay_memory_.size() - 1)(
+            random_engine);
+    transitions.push_back(random_transition_idx);
+  }
+  return transitions;
+}
+
+void DQN::UpdateStudent() {
+  assert(student_solver_);
+  const auto transitions = SampleTransitions();
+  FramesLayerInputData frames_input;
+  for (auto i = 0; i < kMinibatchSize; ++i) {
+    CopyInputFrames(std::get<0>(replay_memory_[transitions[i]]), i,
+                    frames_input);
+  }
+  // The primary network's Q-values of every legal action are the targets
+  InputDataIntoLayers(*net_, frames_input, dummy_input_data_,
+                      dummy_input_data_);
+  net_->ForwardPrefilled(nullptr);
+  const auto q_values = net_->blob_by_name("q_values")->cpu_data();
+  TargetLayerInputData target_input;
+  FilterLayerInputData filter_input;
+  std::fill(target_input.begin(), target_input.end(), 0.0f);
+  std::fill(filter_input.begin(), filter_input.end(), 0.0f);
+  for (auto i = 0; i < kMinibatchSize; ++i) {
+    for (const auto action : legal_actions_) {
+      const auto idx = i * kOutputCount + static_cast<int>(action);
+      target_input[idx] = q_values[idx];
+      filter_input[idx] = 1;
+    }
+  }
+  InputDataIntoLayers(*student_net_, frames_input, target_input, filter_input);
+  student_solver_->Step(1);
+}
+
+double DQN::StudentAgreement(const int num_batches) {
+  assert(student_net_);
+  auto agreed = 0;
+  for (auto batch = 0; batch < num_batches; ++batch) {
+    const auto transitions = SampleTransitions();
+    std::vector<InputFrames> frames_batch;
+    frames_batch.reserve(kMinibatchSize);
+    for (const auto idx : transitions) {
+      frames_batch.push_back(std::get<0>(replay_memory_[idx]));
+    }
+    const auto teacher = SelectActionGreedily(*net_, frames_batch);
+    const auto student = SelectActionGreedily(*student_net_, frames_batch);
+    for (auto i = 0; i < kMinibatchSize; ++i) {
+      if (teacher[i].first == student[i].first) {
+        ++agreed;
+      }
+    }
+  }
+  return agreed / static_cast<double>(num_batches * kMinibatchSize);
 }
 
 void DQN::ClonePrimaryNet() {
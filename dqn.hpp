@@ -22,9 +22,47 @@ constexpr auto kInputDataSize = kCroppedFrameDataSize * kInputFrameCount;
 constexpr auto kMinibatchSize = 32;
 constexpr auto kMinibatchDataSize = kInputDataSize * kMinibatchSize;
 constexpr auto kOutputCount = 18;
+constexpr auto kRamSize = 128;
+
+// A single observation: a preprocessed screen (kCroppedFrameDataSize bytes)
+// or a RAM snapshot (kRamSize bytes), depending on the frames blob of the
+// net. The network input buffers are sized for screens.
+class FrameData {
+public:
+  FrameData(const FrameData&) = delete;
+  FrameData& operator=(const FrameData&) = delete;
+
+  int size() const { return size_; }
+  uint8_t* begin() { return data_; }
+  uint8_t* end() { return data_ + size_; }
+  const uint8_t* begin() const { return data_; }
+  const uint8_t* end() const { return data_ + size_; }
+  uint8_t& operator[](const int i) { return data_[i]; }
+  const uint8_t& operator[](const int i) const { return data_[i]; }
+
+protected:
+  FrameData(uint8_t* data, const int size) : data_(data), size_(size) {}
+
+private:
+  uint8_t* const data_;
+  const int size_;
+};
+
+// The bytes of a frame of a given size, stored in place, so make_shared
+// creates a frame in a single allocation
+template <int kSize>
+class FixedSizeFrameData : public FrameData {
+public:
+  FixedSizeFrameData() : FrameData(bytes_, kSize) {}
+
+private:
+  uint8_t bytes_[kSize];
+};
 
-using FrameData = std::array<uint8_t, kCroppedFrameDataSize>;
 using FrameDataSp = std::shared_ptr<FrameData>;
+
+// Create an uninitialized frame of kCroppedFrameDataSize or kRamSize bytes
+FrameDataSp MakeFrameData(const int size);
 using InputFrames = std::array<FrameDataSp, 4>;
 using Transition = std::tuple<InputFrames, Action,
                               float, boost::optional<FrameDataSp>>;
@@ -37,6 +75,19 @@ using ActionValue = std::pair<Action, float>;
 using SolverSp = std::shared_ptr<caffe::Solver<float>>;
 using NetSp = boost::shared_ptr<caffe::Net<float>>;
 
+/**
+ * The inputs of one update, sampled from replay memory. The sampled
+ * transitions are copied, so replay memory may change once sampling is
+ * done.
+ */
+struct Minibatch {
+  std::vector<Transition> transitions;
+  FramesLayerInputData frames_input;
+  std::vector<InputFrames> target_last_frames; // Of non-terminal transitions
+  TargetLayerInputData target_input;
+  FilterLayerInputData filter_input;
+};
+
 /**
  * Deep Q-Network
  */
@@ -52,6 +103,10 @@ public:
         replay_memory_capacity_(replay_memory_capacity),
         gamma_(gamma),
         clone_frequency_(clone_frequency),
+        frame_data_size_(0),
+        static_forward_(false),
+        distill_freq_(0),
+        act_with_student_(false),
         random_engine(0) {}
 
   // Initialize DQN. Must be called before calling any other method.
@@ -63,9 +118,54 @@ public:
   // Restore solving from a solver file.
   void RestoreSolver(const std::string& solver_file);
 
+  // Restart the random actions and minibatch sampling from seed
+  void Seed(const unsigned seed) { random_engine.seed(seed); }
+
+  // Select actions with the compile-time network generated from the
+  // prototxt (see static_net.hpp). Checks it against Caffe first.
+  void EnableStaticForward();
+
   // Snapshot the current model
   void Snapshot() { solver_->Snapshot(); }
 
+  // Copy the weights of the primary network into net_param
+  void ExportWeights(caffe::NetParameter& net_param) const {
+    net_->ToProto(&net_param);
+  }
+
+  // Load the primary network with weights from ExportWeights
+  void ImportWeights(const caffe::NetParameter& net_param) {
+    net_->CopyTrainedLayersFrom(net_param);
+  }
+
+  // Initialize a smaller student network that is trained to match the
+  // Q-values of the primary network. Update() also updates the student
+  // every distill_freq iterations (never if distill_freq is 0).
+  void InitializeStudent(const caffe::SolverParameter& student_solver_param,
+                         const int distill_freq);
+
+  // Load a trained student model from a file.
+  void LoadStudentModel(const std::string& model_file);
+
+  // Update the student using one minibatch from replay memory
+  void UpdateStudent();
+
+  // Fraction of sampled replay states on which the student and the primary
+  // network select the same greedy action
+  double StudentAgreement(const int num_batches);
+
+  // Snapshot the current student model
+  void SnapshotStudent() { student_solver_->Snapshot(); }
+
+  // Select actions with the student instead of the primary network
+  void set_act_with_student(const bool act_with_student) {
+    assert(!act_with_student || student_net_);
+    act_with_student_ = act_with_student;
+  }
+
+  // Return whether a student network is being distilled
+  bool has_student() const { return static_cast<bool>(student_solver_); }
+
   // Select an action by epsilon-greedy.
   Action SelectAction(const InputFrames& input_frames, double epsilon);
 
@@ -73,18 +173,57 @@ public:
   ActionVect SelectActions(const std::vector<InputFrames>& frames_batch,
                            double epsilon);
 
+  // Select a batch of actions by epsilon-greedy. Each element points to
+  // kInputFrameCount contiguous frames, e.g. a window of a VecEnv.
+  ActionVect SelectActions(const std::vector<const uint8_t*>& frames_batch,
+                           double epsilon);
+
+  // Select a batch of actions by epsilon-greedy with one epsilon per
+  // element. The net is not run when every element acts randomly. The
+  // greedy elements are packed into as few minibatches as possible, but
+  // the MemoryDataLayer cannot be resized, so Caffe still forwards all
+  // kMinibatchSize rows of each one; only the static forward skips the
+  // rows left unused.
+  ActionVect SelectActions(const std::vector<InputFrames>& frames_batch,
+                           const std::vector<double>& epsilons);
+
+  ActionVect SelectActions(const std::vector<const uint8_t*>& frames_batch,
+                           const std::vector<double>& epsilons);
+
   // Add a transition to replay memory
   void AddTransition(const Transition& transition);
 
   // Update DQN using one minibatch
   void Update();
 
+  // The stages of Update(), for callers running them as separate tasks.
+  // Only GatherMinibatch() may run on another thread, concurrently with
+  // the other stages of other minibatches.
+
+  // Clone the primary net if it is due at the current iteration
+  void SyncCloneNet();
+
+  // Sample the transitions of a minibatch
+  void SampleMinibatch(Minibatch& minibatch);
+
+  // Copy the frames of the sampled transitions into the net inputs
+  void GatherMinibatch(Minibatch& minibatch) const;
+
+  // Compute the update targets with the cloned net
+  void ComputeTargets(Minibatch& minibatch);
+
+  // Take a solver step on the minibatch, and a student step when due
+  void Train(const Minibatch& minibatch);
+
   // Clear the replay memory
   void ClearReplayMemory() { replay_memory_.clear(); }
 
   // Get the current size of the replay memory
   int memory_size() const { return replay_memory_.size(); }
 
+  // Return the size of a single frame of the network input
+  int frame_data_size() const { return frame_data_size_; }
+
   // Return the current iteration of the solver
   int current_iteration() const { return solver_->iter(); }
 
@@ -98,10 +237,38 @@ protected:
                                    const InputFrames& last_frames);
 
   // Given a batch of input frames, return a batch of selected actions + values.
+  // Batches larger than kMinibatchSize are forwarded in several chunks.
   std::vector<ActionValue> SelectActionGreedily(
       caffe::Net<float>& net,
       const std::vector<InputFrames>& last_frames);
 
+  // Same as above for inputs whose stacked frames are contiguous.
+  std::vector<ActionValue> SelectActionGreedily(
+      caffe::Net<float>& net,
+      const std::vector<const uint8_t*>& frames_batch);
+
+  // Select actions for the first batch_size inputs of frames_input.
+  std::vector<ActionValue> SelectActionGreedily(
+      caffe::Net<float>& net,
+      const FramesLayerInputData& frames_input,
+      const int batch_size);
+
+  // Select a legal action uniformly at random
+  Action SelectRandomAction();
+
+  // Implementation of the per-element epsilon SelectActions
+  template <typename Frames>
+  ActionVect SelectActionsPerElement(const std::vector<Frames>& frames_batch,
+                                     const std::vector<double>& epsilons);
+
+  // Compute the Q-values of the first batch_size inputs with the
+  // compile-time network, using the current parameters of net_.
+  void StaticForward(const FramesLayerInputData& frames_input,
+                     const int batch_size, float* q_values);
+
+  // Sample a minibatch of replay memory indices uniformly
+  std::vector<int> SampleTransitions();
+
   // Input data into the Frames/Target/Filter layers of the given
   // net. This must be done before forward is called.
   void InputDataIntoLayers(caffe::Net<float>& net,
@@ -120,6 +287,13 @@ protected:
   NetSp net_; // The primary network used for action selection.
   NetSp clone_net_; // Clone of primary net. Used to generate targets.
   TargetLayerInputData dummy_input_data_;
+  int frame_data_size_; // kCroppedFrameDataSize or kRamSize
+  bool static_forward_; // Use StaticForward for action selection
+  SolverSp student_solver_;
+  NetSp student_net_; // Distilled from net_. Cheaper to forward.
+  int distill_freq_; // How often (steps) the student is updated
+  bool act_with_student_;
+  std::unique_ptr<Minibatch> minibatch_; // Reused by Update()
   std::mt19937 random_engine;
 };
 
@@ -128,6 +302,24 @@ protected:
  */
 FrameDataSp PreprocessScreen(const ALEScreen& raw_screen);
 
+/**
+ * Copy the console RAM into a frame
+ */
+FrameDataSp ObserveRam(const ALERAM& ram);
+
+/**
+ * Observe the current state of a game: its preprocessed screen, or its
+ * RAM if ram is set.
+ */
+FrameDataSp Observe(ALEInterface& ale, const bool ram);
+
+/**
+ * Configure an emulator and load a ROM into it. Each act() of the emulator
+ * repeats the action frame_skip times, rendering only the last frame.
+ */
+void InitializeALE(ALEInterface& ale, const bool display_screen,
+                   const std::string& rom, const int frame_skip = 1);
+
 }
 
 #endif /* DQN_HPP_ */
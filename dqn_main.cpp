@@ -5,12 +5,22 @@
 #include <gflags/gflags.h>
 #include "prettyprint.hpp"
 #include "dqn.hpp"
+#include "actor_pool.hpp"
+#include "async_evaluator.hpp"
+#include "cpu_budget.hpp"
+#include "environment.hpp"
+#include "synthetic_environment.hpp"
+#include "vec_env.hpp"
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
-#include <thread>
-#include <mutex>
+#include <glob.h>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <iomanip>
 #include <limits>
+#include <sstream>
+#include <thread>
 
 using namespace boost::filesystem;
 
@@ -19,22 +29,61 @@ DEFINE_bool(gpu, true, "Use GPU to brew Caffe");
 DEFINE_bool(gui, false, "Open a GUI window");
 DEFINE_string(save, "", "Prefix for saving snapshots");
 DEFINE_string(rom, "", "Atari 2600 ROM file to play");
+DEFINE_string(roms, "", "Comma-separated ROM files to train one agent each on, in one process");
+DEFINE_int32(ale_seed, 0, "Seed of the first game, ROM or synthetic. Game i uses ale_seed + i");
+DEFINE_string(record_traces, "", "File prefix to record the actions of every episode into, for replay_trace");
+DEFINE_string(replay_trace, "", "Replay a recorded trace without a network and exit");
+DEFINE_bool(synthetic, false, "Play a synthetic game instead of a ROM, for benchmarks and tests");
+DEFINE_int32(synthetic_actions, 4, "Number of actions of the synthetic game");
+DEFINE_int32(synthetic_episode_frames, 10000, "Length (frames) of synthetic episodes");
+DEFINE_int32(synthetic_frame_cost, 1000, "Work (generator rounds) to emulate a synthetic frame");
 DEFINE_int32(memory, 400000, "Capacity of replay memory");
 DEFINE_int32(explore, 1000000, "Iterations for epsilon to reach given value.");
 DEFINE_double(epsilon, .1, "Value of epsilon after explore iterations.");
+DEFINE_double(epsilon_spread, 0, "Actor i of N explores with epsilon^(1 + spread * i / (N - 1)). 0 gives every actor the same epsilon");
 DEFINE_double(gamma, .99, "Discount factor of future rewards (0,1]");
 DEFINE_int32(clone_freq, 10000, "Frequency (steps) of cloning the target network.");
 DEFINE_int32(memory_threshold, 50000, "Number of transitions to start learning");
+DEFINE_bool(random_warmup, true, "Fill replay memory up to memory_threshold with random actions, without the network, before training");
 DEFINE_int32(skip_frame, 3, "Number of frames skipped");
+DEFINE_bool(ale_frame_skip, false, "Let ALE repeat actions through its frame_skip setting instead of calling act() per frame");
 DEFINE_string(save_screen, "", "File prefix in to save frames");
 DEFINE_string(save_binary_screen, "", "File prefix in to save binary frames");
 DEFINE_string(weights, "", "The pretrained weights load (*.caffemodel).");
+DEFINE_string(evaluate_weights, "", "With evaluate, comma-separated weight files or globs (*.caffemodel) to evaluate together and rank");
+DEFINE_int32(evaluate_concurrency, 4, "Number of weight files of evaluate_weights evaluated at the same time");
 DEFINE_string(snapshot, "", "The solver state to load (*.solverstate).");
 DEFINE_bool(evaluate, false, "Evaluation mode: only playing a game, no updates");
 DEFINE_double(evaluate_with_epsilon, .05, "Epsilon value to be used in evaluation mode");
 DEFINE_int32(evaluate_freq, 250000, "Frequency (steps) between evaluations");
-DEFINE_int32(repeat_games, 32, "Number of games played in evaluation mode");
+DEFINE_bool(evaluate_sequentially, false, "Stream evaluation episodes and stop on the eval_* budgets instead of playing one episode per game");
+DEFINE_int32(eval_min_episodes, 10, "Episodes before a sequential evaluation may stop on its confidence interval");
+DEFINE_int32(eval_max_episodes, 0, "Episodes after which a sequential evaluation stops. 0 uses repeat_games");
+DEFINE_double(eval_relative_ci, .05, "Stop a sequential evaluation once the 95% confidence interval is within this fraction of the mean score. 0 disables");
+DEFINE_double(eval_max_seconds, 0, "Wall-clock budget of a sequential evaluation. 0 disables");
+DEFINE_int64(eval_max_frames, 0, "Emulated frame budget of a sequential evaluation. 0 disables");
+DEFINE_int32(eval_episode_frames, 0, "Cut evaluation episodes after this many frames. 0 disables");
+DEFINE_bool(concurrent_evaluate, true, "Evaluate frozen weights on separate emulators while training goes on. Ignored when distilling a student");
+DEFINE_int32(repeat_games, 32, "Number of games played in parallel");
+DEFINE_int32(start_states, 0, "Number of cached emulator states new episodes start from. 0 resets the game every episode");
+DEFINE_int32(max_start_noops, 30, "Maximum number of NOOP steps taken before capturing a start state");
+DEFINE_bool(double_buffer, false, "Step the games in two groups, selecting actions for one while the other is emulated");
+DEFINE_bool(task_graph, false, "Run each step of the games as a graph of tasks overlapping emulation, minibatch gathering and the nets");
+DEFINE_bool(speculate, false, "Step the games with their previous action while the next ones are selected, keeping the steps whose action is selected again");
+DEFINE_int32(emulator_threads, 0, "Number of threads stepping the games. 0 uses one per actor core");
+DEFINE_int32(eval_emulator_threads, 0, "With --roms, number of threads stepping the evaluation games, beside the training ones on the actor cores. 0 uses the actor cores divided by the number of ROMs");
+DEFINE_string(actor_cores, "", "CPUs, as 0-3,8, to pin the emulator threads to, one per CPU. Empty uses the CPUs not in learner_cores, pinned only if learner_cores is set");
+DEFINE_string(learner_cores, "", "CPUs to pin the main, BLAS and evaluation threads to. Empty uses the CPUs not in actor_cores, pinned only if actor_cores is set");
+DEFINE_int32(blas_threads, 0, "Number of threads of the BLAS library of Caffe. 0 keeps its default. With --roms, the budget split between the agents, 0 meaning one per learner core");
+DEFINE_bool(cpu_report, false, "Log the CPU usage of every thread at each evaluation");
 DEFINE_string(solver, "dqn_solver.prototxt", "Solver parameter file (*.prototxt)");
+DEFINE_string(student_solver, "", "Solver of a distilled student network (*.prototxt)");
+DEFINE_string(student_weights, "", "The pretrained student weights to load (*.caffemodel).");
+DEFINE_int32(distill_freq, 1, "Frequency (steps) of student updates during training. 0 distills only after training");
+DEFINE_int32(distill_iters, 100000, "Number of student updates after training");
+DEFINE_bool(act_with_student, false, "Select actions with the student network");
+DEFINE_bool(ram, false, "Observe the console RAM instead of the screen");
+DEFINE_bool(static_forward, false, "Select actions with the compile-time network generated from dqn.prototxt");
 
 double CalculateEpsilon(const int iter) {
   if (iter < FLAGS_explore) {
@@ -44,6 +93,21 @@ double CalculateEpsilon(const int iter) {
   }
 }
 
+/**
+ * Spread epsilon over the actors, from epsilon for the first actor down to
+ * epsilon^(1 + epsilon_spread) for the last one
+ */
+std::vector<double> ActorEpsilons(const double epsilon, const int num_actors) {
+  std::vector<double> epsilons(num_actors, epsilon);
+  if (FLAGS_epsilon_spread > 0 && num_actors > 1) {
+    for (auto i = 0; i < num_actors; ++i) {
+      epsilons[i] = std::pow(
+          epsilon, 1 + FLAGS_epsilon_spread * i / (num_actors - 1));
+    }
+  }
+  return epsilons;
+}
+
 void SaveScreen(const ALEScreen& screen, const ALEInterface& ale,
                 const string filename) {
   IntMatrix screen_matrix;
@@ -63,278 +127,297 @@ void SaveInputFrames(const dqn::InputFrames& frames, const string filename) {
   ofs.open(filename, ios::out | ios::binary);
   for (int i = 0; i < dqn::kInputFrameCount; ++i) {
     const dqn::FrameData& frame = *frames[i];
-    for (int j = 0; j < dqn::kCroppedFrameDataSize; ++j) {
+    for (int j = 0; j < frame.size(); ++j) {
       ofs.write((char*) &frame[j], sizeof(uint8_t));
     }
   }
   ofs.close();
 }
 
-void InitializeALE(ALEInterface& ale, bool display_screen, std::string& rom) {
-  ale.set("display_screen", display_screen);
-  ale.set("disable_color_averaging", true);
-  ale.loadROM(rom);
+/**
+ * Save the screen and the input frames environment 0 of env is about to
+ * act on for the given step of the episode, as asked by the save_screen
+ * and save_binary_screen flags. The screens of the warm-up NOOP steps are
+ * not seen here, so the screens are numbered from kInputFrameCount - 1 to
+ * keep the numbers of the frames they show.
+ */
+void SaveFrames(dqn::VecEnv& env, const int step) {
+  const auto ale_env =
+      dynamic_cast<dqn::AleEnvironment*>(&env.environment(0));
+  if (!FLAGS_save_screen.empty() && ale_env) {
+    std::stringstream ss;
+    ss << FLAGS_save_screen << setfill('0') << setw(5) <<
+        std::to_string(step + dqn::kInputFrameCount - 1) << ".png";
+    SaveScreen(ale_env->ale().getScreen(), ale_env->ale(), ss.str());
+  }
+  if (!FLAGS_save_binary_screen.empty()) {
+    string fname = FLAGS_save_binary_screen + std::to_string(step) + ".bin";
+    SaveInputFrames(env.input_frames(0), fname);
+  }
 }
 
-std::mutex mtx;
-ActionVect act_to_take;
-std::vector<dqn::InputFrames> frames_batch;
-std::vector<float> rewards;
-std::vector<bool> thread_ready;
-std::vector<bool> thread_done;
-std::vector<bool> action_ready;
-std::vector<double> thread_scores;
+/**
+ * Create the game given by the flags: the ROM, or a synthetic game. The
+ * game is seeded with ale_seed + index, and the episodes of the ROM are
+ * recorded to <record_traces>_<name>_<index>.trace if asked.
+ */
+std::unique_ptr<dqn::Environment> MakeEnvironment(const std::string& rom,
+                                                  const bool display_screen,
+                                                  const std::string& name,
+                                                  const int index) {
+  if (FLAGS_synthetic) {
+    return std::unique_ptr<dqn::Environment>(new dqn::SyntheticEnvironment(
+        FLAGS_ale_seed + index, FLAGS_synthetic_actions,
+        FLAGS_synthetic_episode_frames, FLAGS_synthetic_frame_cost,
+        FLAGS_skip_frame, FLAGS_ram));
+  }
+  std::unique_ptr<dqn::AleEnvironment> environment(new dqn::AleEnvironment(
+      rom, FLAGS_ale_seed + index, FLAGS_skip_frame, FLAGS_ram,
+      display_screen, FLAGS_ale_frame_skip));
+  if (!FLAGS_record_traces.empty() && !name.empty()) {
+    environment->Record(FLAGS_record_traces + "_" + name + "_" +
+                        std::to_string(index) + ".trace");
+  }
+  return environment;
+}
 
 /**
- * Main method used by threads. Plays a single game.
+ * Create the environments of num_envs games of rom, stepped by pool
  */
-void ThreadEvaluate(int id) {
-  mtx.lock();
-  ALEInterface ale;
-  InitializeALE(ale, false, FLAGS_rom);
-  mtx.unlock();
-  std::deque<dqn::FrameDataSp> past_frames;
-  auto total_score = 0;
-  auto reward = 0;
-  while (!ale.game_over()) {
-    const ALEScreen& screen = ale.getScreen();
-    const auto current_frame = dqn::PreprocessScreen(screen);
-    past_frames.push_back(current_frame);
-    if (past_frames.size() < dqn::kInputFrameCount) {
-      for (auto i = 0; i < FLAGS_skip_frame + 1 && !ale.game_over(); ++i) {
-        total_score += ale.act(PLAYER_A_NOOP);
-      }
-      continue;
-    }
-    while (past_frames.size() > dqn::kInputFrameCount) {
-      past_frames.pop_front();
-    }
-    assert(past_frames.size() == dqn::kInputFrameCount);
-    assert(frames_batch.size() >= id);
-    dqn::InputFrames input_frames;
-    std::copy(past_frames.begin(), past_frames.end(), input_frames.begin());
-    mtx.lock();
-    frames_batch[id] = input_frames;
-    thread_ready[id] = true;
-    rewards[id] = reward;
-    mtx.unlock();
-    while (!action_ready[id]) {
-      std::this_thread::yield();
-    }
-    auto immediate_score = 0.0;
-    for (auto i = 0; i < FLAGS_skip_frame + 1 && !ale.game_over(); ++i) {
-      immediate_score += ale.act(act_to_take[id]);
-    }
-    total_score += immediate_score;
-    reward = immediate_score == 0 ? 0 : immediate_score /
-        std::abs(immediate_score);
-    assert(reward <= 1 && reward >= -1);
-    action_ready[id] = false;
-  }
-  LOG(INFO) << "Thread " << id << " Score " << total_score;
-  mtx.lock();
-  thread_done[id] = true;
-  thread_ready[id] = true;
-  thread_scores[id] = total_score;
-  mtx.unlock();
+std::unique_ptr<dqn::VecEnv> MakeVecEnv(
+    const std::string& rom,
+    const std::string& name,
+    const int num_envs,
+    const bool display_screen,
+    const std::shared_ptr<dqn::WorkerPool>& pool) {
+  std::vector<std::unique_ptr<dqn::Environment>> envs;
+  for (auto i = 0; i < num_envs; ++i) {
+    envs.push_back(MakeEnvironment(rom, display_screen, name, i));
+  }
+  std::unique_ptr<dqn::VecEnv> env(new dqn::VecEnv(std::move(envs), pool));
+  env->CacheStartStates(FLAGS_start_states, FLAGS_max_start_noops);
+  return env;
 }
 
 /**
- * Plays kMinibatchSize episodes in parallel using threads. Returns a
- * vector of scores for each thread.
+ * The schedule of the actor pools given by the flags
  */
-std::vector<double> PlayParallelEpisodes(dqn::DQN& dqn, double epsilon,
-                                         bool update) {
-  assert(FLAGS_repeat_games <= dqn::kMinibatchSize);
-  int num_threads = FLAGS_repeat_games;
-  frames_batch.resize(num_threads);
-  rewards.resize(num_threads);
-  act_to_take.resize(num_threads);
-  thread_ready.resize(num_threads);
-  thread_done.resize(num_threads);
-  action_ready.resize(num_threads);
-  thread_scores.resize(num_threads);
-
-  std::fill(act_to_take.begin(), act_to_take.end(), PLAYER_A_NOOP);
-  std::fill(thread_ready.begin(), thread_ready.end(), false);
-  std::fill(thread_done.begin(), thread_done.end(), false);
-  std::fill(action_ready.begin(), action_ready.end(), false);
-  std::fill(thread_scores.begin(), thread_scores.end(), 0.0);
-
-  std::thread threads[num_threads];
-  std::vector<dqn::Transition> games_in_progress[num_threads];
-  std::vector<dqn::InputFrames> past_frames_batch;
-  for (int i=0; i<num_threads; ++i) {
-    threads[i] = std::thread(ThreadEvaluate, i);
-  }
-  while (std::any_of(thread_done.begin(), thread_done.end(),
-                     [](bool done){return !done;})) {
-    if (std::all_of(thread_ready.begin(), thread_ready.end(),
-                    [](bool ready){return ready;})) {
-      if (update) {
-        if (past_frames_batch.empty()) {
-          past_frames_batch.resize(num_threads);
-        } else {
-          for (int i=0; i<num_threads; ++i) {
-            if (!thread_done[i]) {
-              const dqn::FrameDataSp& next_frame =
-                  frames_batch[i][dqn::kInputFrameCount-1];
-              const auto transition = dqn::Transition(
-                  past_frames_batch[i], act_to_take[i], rewards[i], next_frame);
-              dqn.AddTransition(transition);
-              if (dqn.memory_size() > FLAGS_memory_threshold) {
-                dqn.Update();
-              }
-            }
-          }
-        }
-      }
-      ActionVect av = dqn.SelectActions(frames_batch, epsilon);
-      assert(av.size() == num_threads);
-      for (int i=0; i<num_threads; ++i) {
-        act_to_take[i] = av[i];
-        if (!thread_done[i]) {
-          thread_ready[i] = false;
-        }
-      }
-      if (update) {
-        // Swap the past frames with the current frames
-        past_frames_batch.swap(frames_batch);
-      }
-      std::fill(action_ready.begin(), action_ready.end(), true);
-    } else {
-      std::this_thread::yield();
+dqn::ActorPool::Schedule ActorSchedule() {
+  CHECK(!FLAGS_double_buffer || !FLAGS_task_graph)
+      << "Choose one of double_buffer and task_graph.";
+  return FLAGS_task_graph ? dqn::ActorPool::kTaskGraph :
+      FLAGS_double_buffer ? dqn::ActorPool::kDoubleBuffered :
+      dqn::ActorPool::kSynchronous;
+}
+
+/**
+ * The CPUs the process may use but the given ones, or all of them, with a
+ * warning naming the flag that takes them all, if none is left
+ */
+std::vector<int> CpusLeftBy(const std::string& flag,
+                            const std::vector<int>& taken) {
+  const auto allowed = dqn::AllowedCpus();
+  std::vector<int> rest;
+  for (const auto cpu : allowed) {
+    if (std::find(taken.begin(), taken.end(), cpu) == taken.end()) {
+      rest.push_back(cpu);
     }
   }
-  for (auto& th: threads) {
-    th.join();
-  }
-  if (update) {
-    for (int i=0; i<num_threads; ++i) {
-      const auto transition = dqn::Transition(
-          frames_batch[i], act_to_take[i], rewards[i], boost::none);
-      dqn.AddTransition(transition);
-      if (dqn.memory_size() > FLAGS_memory_threshold) {
-        dqn.Update();
-      }
+  LOG_IF(WARNING, rest.empty())
+      << flag << " leaves no CPU to the other threads, which then share "
+      "all the CPUs";
+  return rest.empty() ? allowed : rest;
+}
+
+/**
+ * The CPUs of the threads stepping the games: actor_cores, or else the
+ * CPUs learner_cores leaves to the process, or all of them. The first call
+ * must come before the process is pinned.
+ */
+const std::vector<int>& ActorCpus() {
+  static const auto cpus = []() -> std::vector<int> {
+    if (!FLAGS_actor_cores.empty()) {
+      return dqn::ParseCpuList(FLAGS_actor_cores);
     }
-  }
-  return thread_scores;
+    if (FLAGS_learner_cores.empty()) {
+      return dqn::AllowedCpus();
+    }
+    return CpusLeftBy("learner_cores",
+                      dqn::ParseCpuList(FLAGS_learner_cores));
+  }();
+  return cpus;
 }
 
 /**
- * Play one episode and return the total score
+ * The CPUs of the main, BLAS and evaluation threads: learner_cores, or
+ * else the CPUs actor_cores leaves to the process, or all of them. The
+ * first call must come before the process is pinned.
  */
-double PlayOneEpisode(ALEInterface& ale, dqn::DQN& dqn, const double epsilon,
-                      const bool update) {
-  CHECK(!ale.game_over());
-  std::deque<dqn::FrameDataSp> past_frames;
-  auto total_score = 0.0;
-  for (auto frame = 0; !ale.game_over(); ++frame) {
-    const ALEScreen& screen = ale.getScreen();
-    if (!FLAGS_save_screen.empty()) {
-      std::stringstream ss;
-      ss << FLAGS_save_screen << setfill('0') << setw(5) <<
-          std::to_string(frame) << ".png";
-      SaveScreen(screen, ale, ss.str());
+const std::vector<int>& LearnerCpus() {
+  static const auto cpus = []() -> std::vector<int> {
+    if (!FLAGS_learner_cores.empty()) {
+      return dqn::ParseCpuList(FLAGS_learner_cores);
     }
-    const auto current_frame = dqn::PreprocessScreen(screen);
-    past_frames.push_back(current_frame);
-    if (past_frames.size() < dqn::kInputFrameCount) {
-      // If there are not past frames enough for DQN input, just select NOOP
-      for (auto i = 0; i < FLAGS_skip_frame + 1 && !ale.game_over(); ++i) {
-        total_score += ale.act(PLAYER_A_NOOP);
-      }
-    } else {
-      while (past_frames.size() > dqn::kInputFrameCount) {
-        past_frames.pop_front();
-      }
-      dqn::InputFrames input_frames;
-      std::copy(past_frames.begin(), past_frames.end(), input_frames.begin());
-      if (!FLAGS_save_binary_screen.empty()) {
-        static int binary_save_num = 0;
-        string fname = FLAGS_save_binary_screen +
-            std::to_string(binary_save_num++) + ".bin";
-        SaveInputFrames(input_frames, fname);
-      }
-      const auto action = dqn.SelectAction(input_frames, epsilon);
-      auto immediate_score = 0.0;
-      for (auto i = 0; i < FLAGS_skip_frame + 1 && !ale.game_over(); ++i) {
-        immediate_score += ale.act(action);
-      }
-      total_score += immediate_score;
-      // Rewards for DQN are normalized as follows:
-      // 1 for any positive score, -1 for any negative score, otherwise 0
-      const auto reward = immediate_score == 0 ? 0 : immediate_score /
-          std::abs(immediate_score);
-      assert(reward <= 1 && reward >= -1);
-      if (update) {
-        // Add the current transition to replay memory
-        const auto transition = ale.game_over() ?
-            dqn::Transition(input_frames, action, reward, boost::none) :
-            dqn::Transition(input_frames, action, reward,
-                            dqn::PreprocessScreen(ale.getScreen()));
-        dqn.AddTransition(transition);
-        // If the size of replay memory is large enough, update DQN
-        if (dqn.memory_size() > FLAGS_memory_threshold) {
-          dqn.Update();
-        }
-      }
+    if (FLAGS_actor_cores.empty()) {
+      return dqn::AllowedCpus();
     }
+    return CpusLeftBy("actor_cores", dqn::ParseCpuList(FLAGS_actor_cores));
+  }();
+  return cpus;
+}
+
+/**
+ * Create num_threads threads stepping the games, or one per actor CPU if
+ * it is 0. They are pinned to the actor CPUs if any of actor_cores and
+ * learner_cores is set.
+ */
+std::shared_ptr<dqn::WorkerPool> MakeWorkerPool(const int num_threads) {
+  const auto& actor_cpus = ActorCpus();
+  const auto pool = std::make_shared<dqn::WorkerPool>(
+      num_threads > 0 ? num_threads : static_cast<int>(actor_cpus.size()));
+  if (!FLAGS_actor_cores.empty() || !FLAGS_learner_cores.empty()) {
+    pool->Pin(actor_cpus);
   }
-  ale.reset_game();
-  return total_score;
+  return pool;
 }
 
 /**
  * Evaluate the current player
  */
-double Evaluate(dqn::DQN& dqn) {
-  std::vector<double> scores = PlayParallelEpisodes(
-      dqn, FLAGS_evaluate_with_epsilon, false);
-  double total_score = 0.0;
-  for (auto score : scores) {
-    total_score += score;
-  }
-  const auto avg_score = total_score / static_cast<double>(scores.size());
-  double stddev = 0.0; // Compute the sample standard deviation
-  for (auto i=0; i<scores.size(); ++i) {
-    stddev += (scores[i] - avg_score) * (scores[i] - avg_score);
-  }
-  stddev = sqrt(stddev / static_cast<double>(FLAGS_repeat_games - 1));
-  LOG(INFO) << "Evaluation avg_score = " << avg_score << " std = " << stddev;
-  return avg_score;
+double Evaluate(dqn::DQN& dqn, dqn::ActorPool& actors) {
+  actors.set_max_episode_frames(FLAGS_eval_episode_frames);
+  std::vector<double> scores;
+  if (FLAGS_evaluate_sequentially) {
+    dqn::EvaluationBudget budget;
+    budget.min_episodes = FLAGS_eval_min_episodes;
+    budget.max_episodes = FLAGS_eval_max_episodes > 0 ?
+        FLAGS_eval_max_episodes : FLAGS_repeat_games;
+    budget.relative_ci = FLAGS_eval_relative_ci;
+    budget.max_seconds = FLAGS_eval_max_seconds;
+    budget.max_frames = FLAGS_eval_max_frames;
+    scores = actors.PlayEpisodesSequentially(
+        dqn, FLAGS_evaluate_with_epsilon, budget);
+  } else {
+    scores = actors.PlayEpisodes(dqn, FLAGS_evaluate_with_epsilon, false);
+  }
+  actors.set_max_episode_frames(0);
+  return dqn::ReportEvaluation(scores);
 }
 
-int main(int argc, char** argv) {
-  std::string usage(argv[0]);
-  usage.append(" -rom rom -[evaluate|save path]");
-  gflags::SetUsageMessage(usage);
-  gflags::SetVersionString("0.1");
-  gflags::ParseCommandLineFlags(&argc, &argv, true);
-  google::InitGoogleLogging(argv[0]);
-  google::InstallFailureSignalHandler();
-  // google::LogToStderr();
+/**
+ * Expand a comma-separated list of files and glob patterns, in order
+ */
+std::vector<std::string> ExpandFileList(const std::string& list) {
+  std::vector<std::string> patterns;
+  boost::algorithm::split(patterns, list, boost::is_any_of(","));
+  std::vector<std::string> files;
+  for (const auto& pattern : patterns) {
+    glob_t matches;
+    if (glob(pattern.c_str(), 0, nullptr, &matches) != 0) {
+      globfree(&matches);
+      LOG(ERROR) << "No file matches " << pattern;
+      exit(1);
+    }
+    files.insert(files.end(), matches.gl_pathv,
+                 matches.gl_pathv + matches.gl_pathc);
+    globfree(&matches);
+  }
+  return files;
+}
 
-  if (FLAGS_rom.empty()) {
-    LOG(ERROR) << "Rom file required but not set.";
-    LOG(ERROR) << "Usage: " << gflags::ProgramUsage();
-    exit(1);
+/**
+ * Evaluate several weight files of the same network and log their scores
+ * as a table. Each of the evaluate_concurrency slots has its own net and
+ * games, created once, and evaluates weight files one after the other, in
+ * its own thread. Before every file the games are rewound to the state
+ * they were created in and the net is reseeded, so each file plays the
+ * same episodes whichever slot it lands in. The slots share the emulator
+ * threads.
+ */
+void EvaluateWeights(const std::vector<std::string>& weights_files,
+                     const std::vector<Action>& legal_actions,
+                     const caffe::SolverParameter& solver_param) {
+  const auto pool = MakeWorkerPool(FLAGS_emulator_threads);
+  const int num_slots = std::min<int>(std::max(1, FLAGS_evaluate_concurrency),
+                                      weights_files.size());
+  std::vector<std::unique_ptr<dqn::DQN>> dqns;
+  std::vector<std::unique_ptr<dqn::ActorPool>> actors;
+  for (auto i = 0; i < num_slots; ++i) {
+    dqns.emplace_back(new dqn::DQN(legal_actions, solver_param, 0,
+                                   FLAGS_gamma, FLAGS_clone_freq));
+    dqns.back()->Initialize();
+    actors.emplace_back(new dqn::ActorPool(
+        MakeVecEnv(FLAGS_rom, "eval_" + std::to_string(i),
+                   FLAGS_repeat_games, false, pool),
+        FLAGS_memory_threshold, ActorSchedule(), FLAGS_speculate));
   }
-  path rom_file(FLAGS_rom);
-  if (!is_regular_file(rom_file)) {
-    LOG(ERROR) << "Invalid ROM file: " << FLAGS_rom;
-    exit(1);
+  std::vector<double> scores(weights_files.size());
+  std::atomic<int> next_file(0);
+  const auto caffe_mode = caffe::Caffe::mode();
+  std::vector<std::thread> threads;
+  for (auto i = 0; i < num_slots; ++i) {
+    threads.emplace_back([&, i]() {
+      caffe::Caffe::set_mode(caffe_mode);
+      for (int k; (k = next_file++) < weights_files.size(); ) {
+        LOG(INFO) << "Evaluating " << weights_files[k];
+        dqns[i]->LoadTrainedModel(weights_files[k]);
+        if (FLAGS_static_forward) {
+          dqns[i]->EnableStaticForward();
+        }
+        dqns[i]->Seed(0);
+        actors[i]->Rewind();
+        scores[k] = Evaluate(*dqns[i], *actors[i]);
+      }
+    });
   }
-  if (!is_regular_file(FLAGS_solver)) {
-    LOG(ERROR) << "Invalid solver: " << FLAGS_solver;
-    exit(1);
+  for (auto& thread : threads) {
+    thread.join();
   }
-  if (FLAGS_save.empty() && !FLAGS_evaluate) {
-    LOG(ERROR) << "Save path (or evaluate) required but not set.";
-    LOG(ERROR) << "Usage: " << gflags::ProgramUsage();
-    exit(1);
+  std::ostringstream table;
+  table << "Evaluation of " << weights_files.size() << " weight files:";
+  const auto best = std::max_element(scores.begin(), scores.end());
+  for (auto k = 0; k < weights_files.size(); ++k) {
+    table << "\n  " << std::setw(12) << scores[k] << "  " << weights_files[k]
+          << (scores.begin() + k == best ? "  (best)" : "");
   }
+  LOG(INFO) << table.str();
+}
+
+/**
+ * Compare the distilled student with the network it is distilled from.
+ * acting_score is the score of the network acting with the flags, if it
+ * has just been evaluated, so that only the other one is evaluated. The
+ * action agreement is measured on replay memory, so only while training.
+ */
+void ReportDistillation(dqn::DQN& dqn, dqn::ActorPool& actors,
+                        const boost::optional<double>& acting_score) {
+  constexpr auto kAgreementBatches = 100;
+  std::ostringstream agreement;
+  if (dqn.memory_size() > 0) {
+    agreement << dqn.StudentAgreement(kAgreementBatches);
+  } else {
+    agreement << "n/a (empty replay memory)";
+  }
+  double scores[2]; // Of the teacher and the student
+  for (const auto student : {false, true}) {
+    if (acting_score && student == FLAGS_act_with_student) {
+      scores[student] = *acting_score;
+    } else {
+      dqn.set_act_with_student(student);
+      scores[student] = Evaluate(dqn, actors);
+    }
+  }
+  dqn.set_act_with_student(FLAGS_act_with_student);
+  LOG(INFO) << "Distillation: action agreement = " << agreement.str()
+            << ", teacher avg_score = " << scores[0]
+            << ", student avg_score = " << scores[1];
+}
+
+/**
+ * Return the prefix of the files saved for rom_file, exiting if existing
+ * files would be overwritten
+ */
+path MakeSavePath(const path& rom_file) {
   path save_path(FLAGS_save);
   path snapshot_dir(current_path());
   if (is_directory(save_path)) {
@@ -366,6 +449,250 @@ int main(int argc, char** argv) {
       }
     }
   }
+  return save_path;
+}
+
+/**
+ * An agent trained on one of several ROMs
+ */
+struct Agent {
+  std::string name;
+  std::unique_ptr<dqn::DQN> dqn;
+  std::unique_ptr<dqn::ActorPool> actors;
+  std::unique_ptr<dqn::ActorPool> eval_actors;
+  // With concurrent_evaluate, a frozen copy of dqn evaluated on
+  // eval_actors. The evaluator is destroyed first.
+  std::unique_ptr<dqn::DQN> frozen_dqn;
+  std::unique_ptr<dqn::AsyncEvaluator> evaluator;
+  int max_iter;
+  int last_eval_iter;
+  int episodes;
+  long steps;
+  std::vector<double> scores;
+  double best_score;
+};
+
+/**
+ * Train an agent until its max_iter, evaluating it every evaluate_freq
+ * iterations, while it goes on training if it has an evaluator. Otherwise
+ * only this agent stops playing while it is evaluated. The CPU usage is
+ * logged at each evaluation if cpu_report is set.
+ */
+void TrainAgent(Agent& agent, dqn::CpuUsageReport& cpu_usage) {
+  auto& dqn = *agent.dqn;
+  agent.actors->Start(0);
+  if (FLAGS_random_warmup) {
+    agent.steps += agent.actors->FillReplayMemory(dqn, FLAGS_memory_threshold);
+  }
+  while (dqn.current_iteration() < agent.max_iter) {
+    const auto epsilon = CalculateEpsilon(dqn.current_iteration());
+    agent.steps += agent.actors->Step(
+        dqn, ActorEpsilons(epsilon, agent.actors->num_actors()), true);
+    const auto finished = agent.actors->TakeEpisodeScores();
+    agent.scores.insert(agent.scores.end(), finished.begin(), finished.end());
+    if (agent.scores.size() >= agent.actors->num_actors()) {
+      double total_score = 0.0;
+      for (auto score : agent.scores) {
+        total_score += score;
+      }
+      LOG(INFO) << agent.name << " Episodes " << agent.episodes << "-"
+                << agent.episodes + agent.scores.size() - 1
+                << " avg_score = " << total_score / agent.scores.size()
+                << ", epsilon = " << epsilon
+                << ", iter = " << dqn.current_iteration()
+                << ", steps = " << agent.steps
+                << ", replay_mem_size = " << dqn.memory_size();
+      agent.episodes += agent.scores.size();
+      agent.scores.clear();
+    }
+    if (dqn.current_iteration() >=
+        agent.last_eval_iter + FLAGS_evaluate_freq) {
+      LOG_IF(INFO, FLAGS_cpu_report) << cpu_usage.Take();
+    }
+    if (agent.evaluator &&
+        dqn.current_iteration() >=
+        agent.last_eval_iter + FLAGS_evaluate_freq) {
+      agent.evaluator->Evaluate(dqn);
+      agent.last_eval_iter = dqn.current_iteration();
+    } else if (dqn.current_iteration() >=
+               agent.last_eval_iter + FLAGS_evaluate_freq) {
+      agent.actors->Stop();
+      agent.actors->TakeEpisodeScores();
+      LOG(INFO) << "Evaluating " << agent.name;
+      const auto avg_score = Evaluate(dqn, *agent.eval_actors);
+      LOG(INFO) << agent.name << " iter " << dqn.current_iteration()
+                << " avg_score = " << avg_score;
+      if (avg_score > agent.best_score) {
+        LOG(INFO) << agent.name << " iter " << dqn.current_iteration()
+                  << " New High Score: " << avg_score;
+        agent.best_score = avg_score;
+        dqn.Snapshot();
+      }
+      agent.last_eval_iter = dqn.current_iteration();
+      agent.actors->Start(0);
+    }
+  }
+  agent.actors->Stop();
+  if (agent.evaluator) {
+    agent.evaluator->Evaluate(dqn);
+    agent.evaluator->Wait();
+    return;
+  }
+  LOG(INFO) << "Evaluating " << agent.name;
+  const auto avg_score = Evaluate(dqn, *agent.eval_actors);
+  LOG(INFO) << agent.name << " final avg_score = " << avg_score;
+}
+
+/**
+ * Train one agent per ROM. Each agent runs its nets in its own thread, so
+ * one agent selects actions or updates while the games of the others are
+ * emulated, and evaluating one agent does not stop the others. The agents
+ * share the emulator threads and split the BLAS threads between them.
+ * Their evaluation games have emulator threads of their own, on the same
+ * CPUs, so an evaluation is not queued behind the training steps of the
+ * other agents.
+ */
+void TrainAgents(const std::vector<std::string>& roms,
+                 const caffe::SolverParameter& solver_param,
+                 dqn::CpuUsageReport& cpu_usage) {
+  const auto pool = MakeWorkerPool(FLAGS_emulator_threads);
+  const auto eval_pool = MakeWorkerPool(
+      FLAGS_eval_emulator_threads > 0 ? FLAGS_eval_emulator_threads :
+      std::max(1, static_cast<int>(ActorCpus().size() / roms.size())));
+  std::vector<Agent> agents(roms.size());
+  for (auto i = 0; i < roms.size(); ++i) {
+    auto& agent = agents[i];
+    agent.name = path(roms[i]).stem().native();
+    auto agent_solver_param = solver_param;
+    agent_solver_param.set_snapshot_prefix(
+        MakeSavePath(path(roms[i])).c_str());
+    const auto legal_actions =
+        MakeEnvironment(roms[i], false, "", 0)->MinimalActionSet();
+    agent.dqn.reset(new dqn::DQN(legal_actions, agent_solver_param,
+                                 FLAGS_memory, FLAGS_gamma, FLAGS_clone_freq));
+    agent.dqn->Initialize();
+    if (FLAGS_static_forward) {
+      agent.dqn->EnableStaticForward();
+    }
+    agent.actors.reset(new dqn::ActorPool(
+        MakeVecEnv(roms[i], agent.name + "_train", FLAGS_repeat_games, false,
+                   pool),
+        FLAGS_memory_threshold, ActorSchedule(), FLAGS_speculate));
+    agent.max_iter = agent_solver_param.max_iter();
+    agent.last_eval_iter = 0;
+    agent.episodes = 0;
+    agent.steps = 0;
+    agent.best_score = std::numeric_limits<double>::lowest();
+    agent.eval_actors.reset(new dqn::ActorPool(
+        MakeVecEnv(roms[i], agent.name + "_eval", FLAGS_repeat_games, false,
+                   eval_pool),
+        FLAGS_memory_threshold, ActorSchedule(), FLAGS_speculate));
+    if (FLAGS_concurrent_evaluate) {
+      agent.frozen_dqn.reset(new dqn::DQN(legal_actions, agent_solver_param,
+                                          0, FLAGS_gamma, FLAGS_clone_freq));
+      agent.frozen_dqn->Initialize();
+      if (FLAGS_static_forward) {
+        agent.frozen_dqn->EnableStaticForward();
+      }
+      const auto name = agent.name;
+      auto& eval_actors = *agent.eval_actors;
+      agent.evaluator.reset(new dqn::AsyncEvaluator(
+          *agent.frozen_dqn,
+          [name, &eval_actors](dqn::DQN& frozen) {
+            LOG(INFO) << "Evaluating " << name;
+            const auto avg_score = Evaluate(frozen, eval_actors);
+            LOG(INFO) << name << " avg_score = " << avg_score;
+            return avg_score;
+          },
+          agent_solver_param.snapshot_prefix()));
+    }
+  }
+  // The BLAS threads of all agents together stay within the budget, on
+  // the learner CPUs
+  const auto blas_budget = FLAGS_blas_threads > 0 ? FLAGS_blas_threads :
+      static_cast<int>(LearnerCpus().size());
+  const auto blas_threads =
+      std::max(1, blas_budget / static_cast<int>(agents.size()));
+  const auto caffe_mode = caffe::Caffe::mode();
+  std::vector<std::thread> threads;
+  for (auto& agent : agents) {
+    threads.emplace_back([&agent, &cpu_usage, caffe_mode, blas_threads]() {
+      caffe::Caffe::set_mode(caffe_mode);
+      // OpenMP BLAS libraries keep the thread count per thread
+      dqn::SetBlasThreads(blas_threads);
+      TrainAgent(agent, cpu_usage);
+    });
+    dqn::NameThread(threads.back().native_handle(), "dqn_" + agent.name);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+int main(int argc, char** argv) {
+  std::string usage(argv[0]);
+  usage.append(" -rom rom -[evaluate|save path]");
+  gflags::SetUsageMessage(usage);
+  gflags::SetVersionString("0.1");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  google::InstallFailureSignalHandler();
+  // google::LogToStderr();
+
+  if (!FLAGS_replay_trace.empty()) {
+    const auto scores = dqn::ReplayTrace(FLAGS_replay_trace, FLAGS_ram,
+                                         FLAGS_gui);
+    LOG(INFO) << "Replay scores " << scores;
+    return 0;
+  }
+  CHECK(FLAGS_record_traces.empty() ||
+        (!FLAGS_synthetic && FLAGS_start_states == 0))
+      << "Traces record ROM episodes started by a reset, without start states.";
+
+  std::vector<std::string> roms;
+  if (!FLAGS_roms.empty()) {
+    boost::algorithm::split(roms, FLAGS_roms, boost::is_any_of(","));
+    CHECK(FLAGS_rom.empty() && !FLAGS_synthetic && !FLAGS_evaluate &&
+          !FLAGS_gui && FLAGS_evaluate_weights.empty() &&
+          FLAGS_snapshot.empty() && FLAGS_weights.empty() &&
+          FLAGS_student_solver.empty())
+        << "Training on several ROMs starts new agents from scratch.";
+    for (const auto& rom : roms) {
+      if (!is_regular_file(rom)) {
+        LOG(ERROR) << "Invalid ROM file: " << rom;
+        exit(1);
+      }
+    }
+  } else if (FLAGS_rom.empty() && !FLAGS_synthetic) {
+    LOG(ERROR) << "Rom file required but not set.";
+    LOG(ERROR) << "Usage: " << gflags::ProgramUsage();
+    exit(1);
+  }
+  path rom_file(!roms.empty() ? "multi" :
+                FLAGS_synthetic ? "synthetic" : FLAGS_rom);
+  if (roms.empty() && !FLAGS_synthetic && !is_regular_file(rom_file)) {
+    LOG(ERROR) << "Invalid ROM file: " << FLAGS_rom;
+    exit(1);
+  }
+  // A discarded speculative step would be recorded in the traces
+  CHECK(!FLAGS_speculate || FLAGS_record_traces.empty())
+      << "Speculation cannot record traces.";
+  LOG_IF(WARNING, FLAGS_speculate &&
+         (FLAGS_double_buffer || FLAGS_task_graph))
+      << "Only synchronously stepped games are stepped speculatively.";
+  if (FLAGS_ram && gflags::GetCommandLineFlagInfoOrDie("solver").is_default) {
+    FLAGS_solver = "dqn_ram_solver.prototxt";
+  }
+  if (!is_regular_file(FLAGS_solver)) {
+    LOG(ERROR) << "Invalid solver: " << FLAGS_solver;
+    exit(1);
+  }
+  if (FLAGS_save.empty() && !FLAGS_evaluate) {
+    LOG(ERROR) << "Save path (or evaluate) required but not set.";
+    LOG(ERROR) << "Usage: " << gflags::ProgramUsage();
+    exit(1);
+  }
+  const auto save_path = MakeSavePath(rom_file);
   // Set the logging destinations
   google::SetLogDestination(google::GLOG_INFO,
                             (save_path.native() + "_INFO_").c_str());
@@ -382,11 +709,27 @@ int main(int argc, char** argv) {
     caffe::Caffe::set_mode(caffe::Caffe::CPU);
   }
 
-  ALEInterface ale;
-  InitializeALE(ale, FLAGS_gui, FLAGS_rom);
+  // Threads started from now on inherit the CPUs of the main thread. The
+  // emulator threads are pinned to the actor CPUs, found before that.
+  if (FLAGS_blas_threads > 0) {
+    dqn::SetBlasThreads(FLAGS_blas_threads);
+  }
+  ActorCpus();
+  if (!FLAGS_learner_cores.empty() || !FLAGS_actor_cores.empty()) {
+    dqn::PinProcess(LearnerCpus());
+  }
+  dqn::CpuUsageReport cpu_usage;
+
+  if (!roms.empty()) {
+    caffe::SolverParameter solver_param;
+    caffe::ReadProtoFromTextFileOrDie(FLAGS_solver, &solver_param);
+    TrainAgents(roms, solver_param, cpu_usage);
+    return 0;
+  }
 
   // Get the vector of legal actions
-  const auto legal_actions = ale.getMinimalActionSet();
+  const auto legal_actions =
+      MakeEnvironment(FLAGS_rom, false, "", 0)->MinimalActionSet();
 
   CHECK(FLAGS_snapshot.empty() || FLAGS_weights.empty())
       << "Give a snapshot to resume training or weights to finetune "
@@ -397,6 +740,18 @@ int main(int argc, char** argv) {
   caffe::ReadProtoFromTextFileOrDie(FLAGS_solver, &solver_param);
   solver_param.set_snapshot_prefix(save_path.c_str());
 
+  if (!FLAGS_evaluate_weights.empty()) {
+    CHECK(FLAGS_evaluate && !FLAGS_gui && FLAGS_snapshot.empty() &&
+          FLAGS_weights.empty() && FLAGS_student_solver.empty())
+        << "Evaluating several weight files is an evaluation-only mode.";
+    // Traces do not record the rewinds between files
+    CHECK(FLAGS_record_traces.empty())
+        << "Games are not recorded when evaluating several weight files.";
+    EvaluateWeights(ExpandFileList(FLAGS_evaluate_weights), legal_actions,
+                    solver_param);
+    return 0;
+  }
+
   dqn::DQN dqn(legal_actions, solver_param, FLAGS_memory, FLAGS_gamma,
                FLAGS_clone_freq);
   dqn.Initialize();
@@ -413,45 +768,177 @@ int main(int argc, char** argv) {
     dqn.LoadTrainedModel(FLAGS_weights);
   }
 
+  if (FLAGS_static_forward) {
+    dqn.EnableStaticForward();
+  }
+
+  CHECK(!FLAGS_act_with_student || !FLAGS_student_solver.empty())
+      << "Acting with a student requires a student solver.";
+  if (!FLAGS_student_solver.empty()) {
+    caffe::SolverParameter student_solver_param;
+    caffe::ReadProtoFromTextFileOrDie(FLAGS_student_solver,
+                                      &student_solver_param);
+    student_solver_param.set_snapshot_prefix(save_path.native() + "_student");
+    dqn.InitializeStudent(student_solver_param, FLAGS_distill_freq);
+    if (!FLAGS_student_weights.empty()) {
+      LOG(INFO) << "Loading student from " << FLAGS_student_weights;
+      dqn.LoadStudentModel(FLAGS_student_weights);
+    }
+    dqn.set_act_with_student(FLAGS_act_with_student);
+  }
+
+  if (FLAGS_evaluate && FLAGS_gui) {
+    // The displaying emulator is stepped on the main thread, the only one
+    // it may draw from, so its worker pool stays idle
+    const auto env = MakeVecEnv(FLAGS_rom, "gui", 1, true,
+                                std::make_shared<dqn::WorkerPool>(1));
+    env->ResetOn(0);
+    auto step = 0;
+    do {
+      SaveFrames(*env, step++);
+      env->StepOn(0, dqn.SelectAction(env->input_frames(0),
+                                      FLAGS_evaluate_with_epsilon));
+    } while (!env->terminal(0));
+    LOG(INFO) << "Score " << env->episode_score(0);
+    return 0;
+  }
+
+  // The actors and their emulators live until the end of the run. The
+  // training and evaluation games share the emulator threads.
+  const auto pool = MakeWorkerPool(FLAGS_emulator_threads);
+  dqn::ActorPool actors(
+      MakeVecEnv(FLAGS_rom, "train", FLAGS_repeat_games, false, pool),
+      FLAGS_memory_threshold, ActorSchedule(), FLAGS_speculate);
+
   if (FLAGS_evaluate) {
-    if (FLAGS_gui) {
-      auto score = PlayOneEpisode(ale, dqn, FLAGS_evaluate_with_epsilon, false);
-      LOG(INFO) << "Score " << score;
+    if (dqn.has_student() && !FLAGS_student_weights.empty()) {
+      ReportDistillation(dqn, actors, boost::none);
     } else {
-      Evaluate(dqn);
+      Evaluate(dqn, actors);
     }
     return 0;
   }
 
+  // Concurrent evaluation plays on its own emulators with a frozen copy of
+  // the DQN. A student is evaluated alongside its teacher on the training
+  // actors, which stop during evaluation.
+  std::unique_ptr<dqn::DQN> frozen_dqn;
+  std::unique_ptr<dqn::ActorPool> eval_actors;
+  std::unique_ptr<dqn::AsyncEvaluator> evaluator;
+  if (FLAGS_concurrent_evaluate && !dqn.has_student()) {
+    frozen_dqn.reset(new dqn::DQN(legal_actions, solver_param, 0,
+                                  FLAGS_gamma, FLAGS_clone_freq));
+    frozen_dqn->Initialize();
+    if (FLAGS_static_forward) {
+      frozen_dqn->EnableStaticForward();
+    }
+    eval_actors.reset(new dqn::ActorPool(
+        MakeVecEnv(FLAGS_rom, "eval", FLAGS_repeat_games, false, pool),
+        FLAGS_memory_threshold, ActorSchedule(), FLAGS_speculate));
+    evaluator.reset(new dqn::AsyncEvaluator(
+        *frozen_dqn,
+        [&](dqn::DQN& frozen) { return Evaluate(frozen, *eval_actors); },
+        save_path.native()));
+  }
+
+  // Actors play episodes back to back. Training is driven by steps, and
+  // scores are logged for every num_actors finished episodes.
   int last_eval_iter = 0;
-  int play_batch = 0;
+  int episodes = 0;
+  long steps = 0;
+  std::vector<double> scores;
   double best_score = std::numeric_limits<double>::min();
+  actors.Start(0);
+  if (FLAGS_random_warmup) {
+    steps += actors.FillReplayMemory(dqn, FLAGS_memory_threshold);
+  }
+  // Wall-clock rate of the training steps, the measure that compares
+  // schedules: emulated_fps leaves out the time the net runs
+  auto rate_start = std::chrono::steady_clock::now();
+  auto rate_steps = steps;
   while (dqn.current_iteration() < solver_param.max_iter()) {
     double epsilon = CalculateEpsilon(dqn.current_iteration());
-    std::vector<double> scores = PlayParallelEpisodes(dqn, epsilon, true);
-    double total_score = 0.0;
-    for (auto score : scores) {
-      total_score += score;
+    steps += actors.Step(
+        dqn, ActorEpsilons(epsilon, actors.num_actors()), true);
+    const auto finished = actors.TakeEpisodeScores();
+    scores.insert(scores.end(), finished.begin(), finished.end());
+    if (scores.size() >= actors.num_actors()) {
+      double total_score = 0.0;
+      for (auto score : scores) {
+        total_score += score;
+      }
+      const auto avg_score = total_score / static_cast<double>(scores.size());
+      const auto now = std::chrono::steady_clock::now();
+      const auto steps_per_second = (steps - rate_steps) /
+          std::chrono::duration<double>(now - rate_start).count();
+      rate_start = now;
+      rate_steps = steps;
+      LOG(INFO) << "Episodes " << episodes << "-"
+                << episodes + scores.size() - 1
+                << " avg_score = " << avg_score
+                << ", epsilon = " << epsilon
+                << ", iter = " << dqn.current_iteration()
+                << ", steps = " << steps
+                << ", steps_per_second = " << steps_per_second
+                << ", emulated_fps = " << actors.TakeFramesPerSecond()
+                << ", replay_mem_size = " << dqn.memory_size();
+      LOG_IF(INFO, FLAGS_speculate) << "Speculation hit rate = "
+                                    << actors.TakeSpeculationHitRate();
+      LOG_IF(INFO, FLAGS_task_graph) << actors.TakeTaskProfile();
+      episodes += scores.size();
+      scores.clear();
     }
-    const auto avg_score = total_score / static_cast<double>(scores.size());
-    LOG(INFO) << "PlayBatch " << play_batch << " avg_score = " << avg_score
-              << ", epsilon = " << epsilon
-              << ", iter = " << dqn.current_iteration()
-              << ", replay_mem_size = " << dqn.memory_size();
-    play_batch++;
-
-    if (dqn.current_iteration() >= last_eval_iter + FLAGS_evaluate_freq) {
-      double avg_score = Evaluate(dqn);
+
+    LOG_IF(INFO, FLAGS_cpu_report &&
+           dqn.current_iteration() >= last_eval_iter + FLAGS_evaluate_freq)
+        << cpu_usage.Take();
+    if (evaluator &&
+        dqn.current_iteration() >= last_eval_iter + FLAGS_evaluate_freq) {
+      evaluator->Evaluate(dqn);
+      last_eval_iter = dqn.current_iteration();
+    } else if (dqn.current_iteration() >=
+               last_eval_iter + FLAGS_evaluate_freq) {
+      actors.Stop();
+      const auto last_finished = actors.TakeEpisodeScores();
+      scores.insert(scores.end(), last_finished.begin(), last_finished.end());
+      double avg_score = Evaluate(dqn, actors);
       if (avg_score > best_score) {
         LOG(INFO) << "iter " << dqn.current_iteration()
                   << " New High Score: " << avg_score;
         best_score = avg_score;
         dqn.Snapshot();
+        if (dqn.has_student()) {
+          dqn.SnapshotStudent();
+        }
+      }
+      if (dqn.has_student()) {
+        ReportDistillation(dqn, actors, avg_score);
       }
       last_eval_iter = dqn.current_iteration();
+      actors.Start(0);
+      rate_start = std::chrono::steady_clock::now();
+      rate_steps = steps;
     }
   }
-  if (dqn.current_iteration() >= last_eval_iter) {
-    Evaluate(dqn);
+  actors.Stop();
+  boost::optional<double> final_score;
+  if (evaluator) {
+    evaluator->Evaluate(dqn);
+    evaluator->Wait();
+  } else if (dqn.current_iteration() >= last_eval_iter) {
+    final_score = Evaluate(dqn, actors);
+  }
+  if (dqn.has_student()) {
+    LOG(INFO) << "Distilling the student for " << FLAGS_distill_iters
+              << " iterations";
+    for (auto i = 0; i < FLAGS_distill_iters; ++i) {
+      dqn.UpdateStudent();
+    }
+    // Distilling changes only the student
+    if (FLAGS_act_with_student) {
+      final_score = boost::none;
+    }
+    ReportDistillation(dqn, actors, final_score);
+    dqn.SnapshotStudent();
   }
 };
@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <random>
+#include <vector>
+#include <glog/logging.h>
+#include "dqn.hpp"
+#include "dqn_static_net.hpp"
+#include "synthetic_environment.hpp"
+#include "task_graph.hpp"
+#include "vec_env.hpp"
+#include "worker_pool.hpp"
+
+// Checks of the actor pipeline that run without a ROM: the synthetic game,
+// the frame ring and the commands of VecEnv, and the task graph. Also
+// checks the compile-time network against Caffe on the net given as the
+// only argument.
+
+namespace {
+
+constexpr auto kNumEnvs = 6;
+constexpr auto kNumActions = 4;
+constexpr auto kEpisodeFrames = 120;
+constexpr auto kSkipFrame = 3;
+
+std::unique_ptr<dqn::VecEnv> MakeVecEnv(
+    const std::shared_ptr<dqn::WorkerPool>& pool) {
+  std::vector<std::unique_ptr<dqn::Environment>> envs;
+  for (auto i = 0; i < kNumEnvs; ++i) {
+    envs.emplace_back(new dqn::SyntheticEnvironment(
+        i, kNumActions, kEpisodeFrames, 100, kSkipFrame, false));
+  }
+  return std::unique_ptr<dqn::VecEnv>(new dqn::VecEnv(std::move(envs), pool));
+}
+
+std::vector<int> AllEnvs() {
+  std::vector<int> ids(kNumEnvs);
+  for (auto i = 0; i < kNumEnvs; ++i) {
+    ids[i] = i;
+  }
+  return ids;
+}
+
+// An action picked from the step and the environment, repeating the
+// previous one every other step so that speculation both hits and misses
+Action TestAction(const int step, const int env) {
+  const auto minimal_action = (step / 2 + env) % kNumActions;
+  return static_cast<Action>(minimal_action);
+}
+
+void TestSyntheticEnvironment() {
+  dqn::SyntheticEnvironment a(7, kNumActions, kEpisodeFrames, 10,
+                              kSkipFrame, false);
+  dqn::SyntheticEnvironment b(7, kNumActions, kEpisodeFrames, 10,
+                              kSkipFrame, false);
+  CHECK_EQ(a.MinimalActionSet().size(), kNumActions);
+  a.Reset();
+  b.Reset();
+  auto steps = 0;
+  auto score = 0.0;
+  dqn::EnvironmentStateSp middle;
+  std::vector<double> rewards_after_middle;
+  while (!a.GameOver()) {
+    CHECK(!b.GameOver());
+    const auto frame_a = a.Observe();
+    const auto frame_b = b.Observe();
+    CHECK_EQ(frame_a->size(), dqn::kCroppedFrameDataSize);
+    CHECK(std::equal(frame_a->begin(), frame_a->end(), frame_b->begin()));
+    if (steps == 5) {
+      middle = a.CloneState();
+    }
+    const auto action = TestAction(steps, 0);
+    const auto reward = a.Act(action);
+    CHECK_EQ(reward, b.Act(action));
+    if (middle) {
+      rewards_after_middle.push_back(reward);
+    }
+    score += reward;
+    ++steps;
+  }
+  CHECK(b.GameOver());
+  CHECK_EQ(steps * a.frames_per_step(), kEpisodeFrames);
+  CHECK_GT(score, 0.0);
+  // Restoring a state replays the rest of the episode
+  b.RestoreState(*middle);
+  for (auto k = 0; k < rewards_after_middle.size(); ++k) {
+    CHECK(!b.GameOver());
+    CHECK_EQ(b.Act(TestAction(5 + k, 0)), rewards_after_middle[k]);
+  }
+  CHECK(b.GameOver());
+}
+
+void TestFrameRing(const std::shared_ptr<dqn::WorkerPool>& pool) {
+  const auto env = MakeVecEnv(pool);
+  const auto ids = AllEnvs();
+  env->Reset(ids);
+  for (auto step = 0; step < 3 * kEpisodeFrames; ++step) {
+    ActionVect actions;
+    for (const auto i : ids) {
+      actions.push_back(TestAction(step, i));
+    }
+    env->Step(ids, actions);
+    // The window of every environment holds its stacked frames in order
+    for (const auto i : ids) {
+      const auto size = env->frame_data_size();
+      for (auto j = 0; j < dqn::kInputFrameCount; ++j) {
+        const auto& frame = env->input_frames(i)[j];
+        CHECK_EQ(frame->size(), size);
+        CHECK(std::equal(frame->begin(), frame->end(),
+                         env->frames(i) + j * size));
+      }
+    }
+  }
+}
+
+void TestSpeculation(const std::shared_ptr<dqn::WorkerPool>& pool) {
+  const auto plain = MakeVecEnv(pool);
+  const auto speculative = MakeVecEnv(pool);
+  const auto ids = AllEnvs();
+  plain->Reset(ids);
+  speculative->Reset(ids);
+  for (auto step = 0; step < 3 * kEpisodeFrames; ++step) {
+    speculative->SpeculateAsync(ids);
+    ActionVect actions;
+    for (const auto i : ids) {
+      actions.push_back(TestAction(step, i));
+    }
+    speculative->Wait();
+    plain->Step(ids, actions);
+    speculative->Step(ids, actions);
+    for (const auto i : ids) {
+      CHECK_EQ(plain->reward(i), speculative->reward(i));
+      CHECK_EQ(plain->terminal(i), speculative->terminal(i));
+      const auto size = plain->frame_data_size();
+      CHECK(std::equal(plain->frames(i),
+                       plain->frames(i) + dqn::kInputFrameCount * size,
+                       speculative->frames(i)));
+    }
+  }
+  const auto hit_rate = speculative->TakeSpeculationHitRate();
+  CHECK(hit_rate > 0.0 && hit_rate < 1.0) << hit_rate;
+}
+
+void TestRewind(const std::shared_ptr<dqn::WorkerPool>& pool) {
+  const auto env = MakeVecEnv(pool);
+  const auto ids = AllEnvs();
+  env->CacheStartStates(3, 5);
+  std::vector<float> rewards[2];
+  for (auto run = 0; run < 2; ++run) {
+    env->Rewind();
+    env->Reset(ids);
+    for (auto step = 0; step < 2 * kEpisodeFrames; ++step) {
+      ActionVect actions;
+      for (const auto i : ids) {
+        actions.push_back(TestAction(step, i));
+      }
+      env->Step(ids, actions);
+      for (const auto i : ids) {
+        rewards[run].push_back(env->reward(i));
+      }
+    }
+  }
+  CHECK(rewards[0] == rewards[1]);
+}
+
+void TestPlayRandomly(const std::shared_ptr<dqn::WorkerPool>& pool) {
+  const auto env = MakeVecEnv(pool);
+  env->Reset(AllEnvs());
+  const auto steps = 3 * kEpisodeFrames;
+  const auto transitions = env->PlayRandomly(steps);
+  CHECK_EQ(transitions.size(), steps * kNumEnvs);
+  // A reset takes kInputFrameCount - 1 NOOP steps to fill the stacked
+  // frames, so the actor plays the rest of the episode
+  const auto episode_steps = kEpisodeFrames / env->frames_per_step() -
+      (dqn::kInputFrameCount - 1);
+  // The transitions of each environment are contiguous, in order
+  for (auto i = 0; i < kNumEnvs; ++i) {
+    for (auto step = 0; step < steps; ++step) {
+      const auto terminal = !std::get<3>(transitions[i * steps + step]);
+      CHECK_EQ(terminal, (step + 1) % episode_steps == 0);
+    }
+  }
+}
+
+void TestTaskGraph(const std::shared_ptr<dqn::WorkerPool>& pool) {
+  dqn::TaskGraph graph(pool);
+  for (auto run = 0; run < 50; ++run) {
+    std::atomic<int> items_done(0);
+    auto first_done = false;
+    auto last_done = false;
+    const auto first = graph.AddMain("first", [&]() {
+      first_done = true;
+    }, {});
+    const auto items = graph.AddParallel("items", [&](int) {
+      CHECK(first_done);
+      ++items_done;
+    }, AllEnvs(), {first});
+    const auto empty = graph.AddParallel("empty", [](int) {}, {}, {first});
+    graph.AddMain("last", [&]() {
+      CHECK_EQ(items_done.load(), kNumEnvs);
+      last_done = true;
+    }, {items, empty});
+    graph.Run();
+    CHECK(last_done);
+  }
+  const auto profile = graph.TakeProfile();
+  CHECK(profile.find("items: 50 calls") != std::string::npos) << profile;
+}
+
+/**
+ * A DQN whose compile-time network is compared with Caffe row by row
+ */
+class StaticForwardDQN : public dqn::DQN {
+public:
+  using dqn::DQN::DQN;
+
+  // Fill every parameter of the net with Gaussian noise, scaled by the
+  // fan-in for the weights so that the Q-values stay in a sensible range
+  void RandomizeWeights(std::mt19937& random_engine) {
+    for (auto i = 0; i < dqn::static_net::kParamCount; ++i) {
+      const auto layer = net_->layer_by_name(dqn::static_net::kParamLayers[i]);
+      CHECK(layer);
+      auto& blob = *layer->blobs()[i % 2];
+      const auto fan_in = blob.count() / blob.num();
+      const auto stddev = i % 2 == 0 ? 1 / std::sqrt(fan_in) : 0.1;
+      std::normal_distribution<float> noise(0, stddev);
+      std::generate(blob.mutable_cpu_data(),
+                    blob.mutable_cpu_data() + blob.count(),
+                    [&]() { return noise(random_engine); });
+    }
+  }
+
+  // Compare the Q-values of the first batch_size inputs, and check that
+  // the static network leaves the other rows alone
+  void CheckQValues(const dqn::FramesLayerInputData& frames_input,
+                    const int batch_size) {
+    InputDataIntoLayers(*net_, frames_input, dummy_input_data_,
+                        dummy_input_data_);
+    net_->ForwardPrefilled(nullptr);
+    const auto caffe_q_values = net_->blob_by_name("q_values")->cpu_data();
+    std::vector<float> static_q_values(
+        dqn::kMinibatchSize * dqn::kOutputCount,
+        std::numeric_limits<float>::quiet_NaN());
+    StaticForward(frames_input, batch_size, static_q_values.data());
+    for (auto i = 0; i < static_q_values.size(); ++i) {
+      if (i >= batch_size * dqn::kOutputCount) {
+        CHECK(std::isnan(static_q_values[i])) << "Row " << i / dqn::kOutputCount
+                                              << " written";
+        continue;
+      }
+      const auto tolerance =
+          1e-3 * std::max(1.0f, std::abs(caffe_q_values[i]));
+      CHECK(std::abs(static_q_values[i] - caffe_q_values[i]) <= tolerance)
+          << "Batch of " << batch_size << ", row " << i / dqn::kOutputCount
+          << ": " << static_q_values[i] << " vs " << caffe_q_values[i];
+    }
+  }
+
+  // The greedy actions selected by Caffe and by the static network
+  std::pair<ActionVect, ActionVect> SelectBothWays(
+      const std::vector<dqn::InputFrames>& frames_batch) {
+    static_forward_ = false;
+    const auto caffe_actions = SelectActions(frames_batch, 0.0);
+    static_forward_ = true;
+    const auto static_actions = SelectActions(frames_batch, 0.0);
+    return std::make_pair(caffe_actions, static_actions);
+  }
+};
+
+void TestStaticForward(const std::string& net_file) {
+  caffe::Caffe::set_mode(caffe::Caffe::CPU);
+  caffe::SolverParameter solver_param;
+  solver_param.set_net(net_file);
+  const ActionVect legal_actions =
+      {PLAYER_A_NOOP, PLAYER_A_FIRE, PLAYER_A_UP, PLAYER_A_DOWN};
+  StaticForwardDQN dqn(legal_actions, solver_param, 1, 0.99, 1);
+  dqn.Initialize();
+  std::mt19937 random_engine(0);
+  dqn.RandomizeWeights(random_engine);
+  dqn.EnableStaticForward();
+  std::uniform_int_distribution<int> pixel(0, 255);
+  dqn::FramesLayerInputData frames_input;
+  for (const auto batch_size : {1, 7, dqn::kMinibatchSize}) {
+    for (auto& v : frames_input) {
+      v = pixel(random_engine);
+    }
+    dqn.CheckQValues(frames_input, batch_size);
+  }
+  // More inputs than a minibatch are selected in a full and a partial one
+  std::vector<dqn::InputFrames> frames_batch(dqn::kMinibatchSize + 7);
+  for (auto& input_frames : frames_batch) {
+    for (auto& frame : input_frames) {
+      frame = dqn::MakeFrameData(dqn::kCroppedFrameDataSize);
+      for (auto& v : *frame) {
+        v = pixel(random_engine);
+      }
+    }
+  }
+  const auto actions = dqn.SelectBothWays(frames_batch);
+  CHECK(actions.first == actions.second);
+}
+
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::LogToStderr();
+  CHECK_EQ(argc, 2) << "Usage: " << argv[0] << " dqn.prototxt";
+  const auto pool = std::make_shared<dqn::WorkerPool>(3);
+  TestSyntheticEnvironment();
+  TestFrameRing(pool);
+  TestSpeculation(pool);
+  TestRewind(pool);
+  TestPlayRandomly(pool);
+  TestTaskGraph(pool);
+  TestStaticForward(argv[1]);
+  LOG(INFO) << "All tests passed";
+}
@@ -0,0 +1,125 @@
+#include "environment.hpp"
+#include <cassert>
+#include <chrono>
+#include <sstream>
+#include <glog/logging.h>
+
+namespace dqn {
+
+namespace {
+
+struct AleState : public EnvironmentState {
+  explicit AleState(const ALEState& state) : state(state) {}
+  const ALEState state;
+};
+
+}
+
+AleEnvironment::AleEnvironment(const std::string& rom,
+                               const int seed,
+                               const int skip_frame,
+                               const bool ram,
+                               const bool display_screen,
+                               const bool ale_frame_skip) :
+    rom_(rom),
+    seed_(seed),
+    skip_frame_(skip_frame),
+    ram_(ram),
+    ale_frame_skip_(ale_frame_skip),
+    act_calls_(ale_frame_skip ? 1 : skip_frame + 1) {
+  ale_.set("random_seed", seed);
+  InitializeALE(ale_, display_screen, rom,
+                ale_frame_skip ? skip_frame + 1 : 1);
+}
+
+void AleEnvironment::Record(const std::string& trace_file) {
+  trace_.reset(new std::ofstream(trace_file));
+  CHECK(*trace_) << "Cannot write the trace " << trace_file;
+  *trace_ << rom_ << '\n' << seed_ << ' ' << skip_frame_ << ' '
+          << ale_frame_skip_;
+}
+
+void AleEnvironment::Reset() {
+  ale_.reset_game();
+  if (trace_) {
+    // Each episode is one line of actions
+    *trace_ << "\nepisode";
+  }
+}
+
+double AleEnvironment::Act(const Action action) {
+  if (trace_) {
+    *trace_ << ' ' << action;
+  }
+  auto score = 0.0;
+  for (auto i = 0; i < act_calls_ && !ale_.game_over(); ++i) {
+    score += ale_.act(action);
+  }
+  return score;
+}
+
+EnvironmentStateSp AleEnvironment::CloneState() {
+  return std::make_shared<AleState>(ale_.cloneState());
+}
+
+void AleEnvironment::RestoreState(const EnvironmentState& state) {
+  assert(dynamic_cast<const AleState*>(&state));
+  ale_.restoreState(static_cast<const AleState&>(state).state);
+}
+
+EnvironmentStateSp AleEnvironment::CloneSystemState() {
+  return std::make_shared<AleState>(ale_.cloneSystemState());
+}
+
+void AleEnvironment::RestoreSystemState(const EnvironmentState& state) {
+  assert(dynamic_cast<const AleState*>(&state));
+  ale_.restoreSystemState(static_cast<const AleState&>(state).state);
+}
+
+std::vector<double> ReplayTrace(const std::string& trace_file,
+                                const bool ram,
+                                const bool display_screen) {
+  std::ifstream trace(trace_file);
+  CHECK(trace) << "Cannot read the trace " << trace_file;
+  std::string rom;
+  int seed, skip_frame;
+  bool ale_frame_skip;
+  std::getline(trace, rom);
+  trace >> seed >> skip_frame >> ale_frame_skip;
+  CHECK(trace) << "Invalid trace header in " << trace_file;
+  AleEnvironment environment(rom, seed, skip_frame, ram, display_screen,
+                             ale_frame_skip);
+  std::vector<double> scores;
+  auto act_seconds = 0.0;
+  auto observe_seconds = 0.0;
+  long steps = 0;
+  std::string line;
+  while (std::getline(trace, line)) {
+    std::istringstream episode(line);
+    std::string tag;
+    if (!(episode >> tag)) {
+      continue;
+    }
+    CHECK_EQ(tag, "episode") << "Invalid trace line: " << line;
+    environment.Reset();
+    environment.Observe();
+    auto score = 0.0;
+    for (int action; episode >> action; ++steps) {
+      const auto start = std::chrono::steady_clock::now();
+      score += environment.Act(static_cast<Action>(action));
+      const auto acted = std::chrono::steady_clock::now();
+      environment.Observe();
+      act_seconds += std::chrono::duration<double>(acted - start).count();
+      observe_seconds += std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - acted).count();
+    }
+    LOG(INFO) << "Episode " << scores.size() << " Score " << score;
+    scores.push_back(score);
+  }
+  LOG(INFO) << "Replayed " << scores.size() << " episodes, " << steps
+            << " steps: act " << act_seconds << " s, observe "
+            << observe_seconds << " s";
+  return scores;
+}
+
+}
@@ -0,0 +1,132 @@
+#ifndef ENVIRONMENT_HPP_
+#define ENVIRONMENT_HPP_
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ale_interface.hpp>
+#include "dqn.hpp"
+
+namespace dqn {
+
+/**
+ * Opaque snapshot of an Environment, restored by the environment that
+ * cloned it or another one of the same kind and game
+ */
+class EnvironmentState {
+public:
+  virtual ~EnvironmentState() {}
+};
+
+using EnvironmentStateSp = std::shared_ptr<const EnvironmentState>;
+
+/**
+ * A game played by an actor, one agent step at a time
+ */
+class Environment {
+public:
+  virtual ~Environment() {}
+
+  // Start a new game
+  virtual void Reset() = 0;
+
+  // Take action for one agent step and return the score it earned
+  virtual double Act(const Action action) = 0;
+
+  virtual bool GameOver() const = 0;
+
+  // Observe the current state: a preprocessed screen or the RAM
+  virtual FrameDataSp Observe() = 0;
+
+  virtual EnvironmentStateSp CloneState() = 0;
+
+  virtual void RestoreState(const EnvironmentState& state) = 0;
+
+  // Same as CloneState() and RestoreState(), but including the random
+  // number generator of the emulator, so the same actions replay the same
+  // games from the restored state
+  virtual EnvironmentStateSp CloneSystemState() = 0;
+
+  virtual void RestoreSystemState(const EnvironmentState& state) = 0;
+
+  virtual ActionVect MinimalActionSet() = 0;
+
+  // Size of the frames returned by Observe()
+  virtual int frame_data_size() const = 0;
+
+  // Emulated frames per agent step
+  virtual int frames_per_step() const = 0;
+};
+
+/**
+ * A game of the Arcade Learning Environment. An agent step repeats its
+ * action skip_frame + 1 times, through the frame_skip setting of ALE if
+ * ale_frame_skip is set. ALE is seeded with seed, so the same actions from
+ * a new environment give the same screens.
+ */
+class AleEnvironment : public Environment {
+public:
+  AleEnvironment(const std::string& rom,
+                 const int seed,
+                 const int skip_frame,
+                 const bool ram,
+                 const bool display_screen,
+                 const bool ale_frame_skip);
+
+  // Record the settings and the actions of every episode into trace_file,
+  // for ReplayTrace. Cloned states are not recorded, so they must not be
+  // restored while recording.
+  void Record(const std::string& trace_file);
+
+  void Reset() override;
+
+  double Act(const Action action) override;
+
+  bool GameOver() const override { return ale_.game_over(); }
+
+  FrameDataSp Observe() override { return dqn::Observe(ale_, ram_); }
+
+  EnvironmentStateSp CloneState() override;
+
+  void RestoreState(const EnvironmentState& state) override;
+
+  EnvironmentStateSp CloneSystemState() override;
+
+  void RestoreSystemState(const EnvironmentState& state) override;
+
+  ActionVect MinimalActionSet() override {
+    return ale_.getMinimalActionSet();
+  }
+
+  int frame_data_size() const override {
+    return ram_ ? kRamSize : kCroppedFrameDataSize;
+  }
+
+  int frames_per_step() const override { return skip_frame_ + 1; }
+
+  ALEInterface& ale() { return ale_; }
+
+protected:
+  const std::string rom_;
+  const int seed_;
+  const int skip_frame_;
+  const bool ram_;
+  const bool ale_frame_skip_;
+  const int act_calls_; // Calls to ALEInterface::act per step
+  ALEInterface ale_;
+  std::unique_ptr<std::ofstream> trace_;
+};
+
+/**
+ * Replay the episodes of a trace written by AleEnvironment::Record in a
+ * new environment, observing every step as actors do, without a network.
+ * Logs the time spent emulating and observing. Returns the scores.
+ */
+std::vector<double> ReplayTrace(const std::string& trace_file,
+                                const bool ram,
+                                const bool display_screen);
+
+}
+
+#endif /* ENVIRONMENT_HPP_ */
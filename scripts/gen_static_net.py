@@ -0,0 +1,169 @@
+#!/usr/bin/env python
+"""Generate a C++ header with a compile-time version of a DQN prototxt.
+
+usage: gen_static_net.py net.prototxt output.hpp
+
+The header describes every layer between the "frames" blob and the
+"q_values" blob with constexpr shapes, and defines a Forward() function
+built from the templates in static_net.hpp. Only the layer types used by
+dqn.prototxt are supported (convolution, (leaky) relu and inner product).
+"""
+import os
+import re
+import sys
+
+TOKEN_RE = re.compile(r'"[^"]*"|[{}:]|[^\s{}:"]+')
+
+
+def tokenize(text):
+  text = re.sub(r'#[^\n]*', '', text)
+  return TOKEN_RE.findall(text)
+
+
+def parse_message(tokens, pos):
+  """Parse 'key: value' and 'key { ... }' pairs until a closing brace."""
+  fields = []
+  while pos < len(tokens) and tokens[pos] != '}':
+    key = tokens[pos]
+    pos += 1
+    if tokens[pos] == ':':
+      pos += 1
+    if tokens[pos] == '{':
+      value, pos = parse_message(tokens, pos + 1)
+      pos += 1
+    else:
+      value = tokens[pos].strip('"')
+      pos += 1
+    fields.append((key, value))
+  return fields, pos
+
+
+def get(fields, key, default=None):
+  for k, v in fields:
+    if k == key:
+      return v
+  return default
+
+
+def get_all(fields, key):
+  return [v for k, v in fields if k == key]
+
+
+def to_int(value):
+  return int(float(value))
+
+
+def identifier(name):
+  name = re.sub(r'_layer$', '', name)
+  return ''.join(part.capitalize() for part in re.split(r'[^0-9a-zA-Z]', name))
+
+
+def find_frames_shape(layers):
+  for layer in layers:
+    if 'frames' in get_all(layer, 'top'):
+      param = get(layer, 'memory_data_param')
+      return (to_int(get(param, 'channels')), to_int(get(param, 'height')),
+              to_int(get(param, 'width')))
+  sys.exit('No layer produces the "frames" blob')
+
+
+def main():
+  if len(sys.argv) != 3:
+    sys.exit(__doc__)
+  prototxt, output = sys.argv[1], sys.argv[2]
+  with open(prototxt) as f:
+    fields, _ = parse_message(tokenize(f.read()), 0)
+  layers = get_all(fields, 'layers') + get_all(fields, 'layer')
+
+  channels, height, width = find_frames_shape(layers)
+
+  def data(blob):
+    if blob in ('frames', 'q_values'):
+      return blob
+    return 'ws->%s.data()' % blob
+
+  blob = 'frames'
+  shape = (channels, height, width)
+  decls = []
+  forward = []
+  params = []
+  buffers = []
+  visited = []
+  while blob != 'q_values':
+    layer = next((l for l in layers if blob in get_all(l, 'bottom') and
+                  not any(l is v for v in visited) and
+                  get(l, 'type').upper() in
+                  ('CONVOLUTION', 'RELU', 'INNER_PRODUCT', 'INNERPRODUCT')),
+                 None)
+    if layer is None:
+      sys.exit('No supported layer consumes blob "%s"' % blob)
+    visited.append(layer)
+    name = get(layer, 'name')
+    kind = get(layer, 'type').upper()
+    top = get(layer, 'top')
+    ident = identifier(name)
+    if kind == 'RELU':
+      if top != blob:
+        sys.exit('Only in-place ReLU layers are supported: ' + name)
+      slope = float(get(get(layer, 'relu_param', []), 'negative_slope', 0))
+      forward.append('  LeakyReLU<%d>(%s, %rf);' %
+                     (shape[0] * shape[1] * shape[2], data(blob), slope))
+      blob = top
+      continue
+    if kind == 'CONVOLUTION':
+      conv = get(layer, 'convolution_param')
+      num_output = to_int(get(conv, 'num_output'))
+      kernel = to_int(get(conv, 'kernel_size'))
+      stride = to_int(get(conv, 'stride', 1))
+      pad = to_int(get(conv, 'pad', 0))
+      decls.append('using %s = Convolution<%d, %d, %d, %d, %d, %d, %d>;' %
+                   (ident, shape[0], shape[1], shape[2], num_output,
+                    kernel, stride, pad))
+      shape = (num_output, (shape[1] + 2 * pad - kernel) // stride + 1,
+               (shape[2] + 2 * pad - kernel) // stride + 1)
+    else:
+      ip = get(layer, 'inner_product_param')
+      num_output = to_int(get(ip, 'num_output'))
+      decls.append('using %s = InnerProduct<%d, %d>;' %
+                   (ident, shape[0] * shape[1] * shape[2], num_output))
+      shape = (num_output, 1, 1)
+    if top != 'q_values':
+      buffers.append('  std::array<float, %s::kOutputSize> %s;' % (ident, top))
+    forward.append('  %s::Forward(%s, params[%d], params[%d], %s);' %
+                   (ident, data(blob), len(params), len(params) + 1,
+                    data(top)))
+    params += ['"%s"' % name] * 2
+    blob = top
+
+  guard = re.sub(r'\W', '_', os.path.basename(output)).upper() + '_'
+  with open(output, 'w') as f:
+    f.write('// Generated by scripts/gen_static_net.py from %s. Do not edit.\n'
+            % os.path.basename(prototxt))
+    f.write('#ifndef %s\n#define %s\n\n' % (guard, guard))
+    f.write('#include <array>\n#include "static_net.hpp"\n\n')
+    f.write('namespace dqn {\nnamespace static_net {\n\n')
+    f.write('constexpr auto kInputChannels = %d;\n' % channels)
+    f.write('constexpr auto kInputHeight = %d;\n' % height)
+    f.write('constexpr auto kInputWidth = %d;\n' % width)
+    f.write('constexpr auto kInputSize = %d;\n' % (channels * height * width))
+    f.write('constexpr auto kOutputSize = %d;\n\n' % shape[0])
+    f.write('\n'.join(decls) + '\n\n')
+    f.write('// Layer owning each parameter blob, in the order Forward() '
+            'expects them.\n')
+    f.write('// Even entries are weights, odd entries are biases.\n')
+    f.write('constexpr auto kParamCount = %d;\n' % len(params))
+    f.write('constexpr const char* kParamLayers[kParamCount] = {\n  %s\n};\n\n'
+            % ',\n  '.join(params))
+    f.write('using Params = std::array<const float*, kParamCount>;\n\n')
+    f.write('// Intermediate activations of a single forward pass.\n')
+    f.write('struct Workspace {\n%s\n};\n\n' % '\n'.join(buffers))
+    f.write('// Compute the Q-values of a single input.\n')
+    f.write('inline void Forward(const float* frames, const Params& params,\n'
+            '                    Workspace* ws, float* q_values) {\n')
+    f.write('\n'.join(forward) + '\n}\n\n')
+    f.write('} // namespace static_net\n} // namespace dqn\n\n')
+    f.write('#endif /* %s */\n' % guard)
+
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,94 @@
+#ifndef STATIC_NET_HPP_
+#define STATIC_NET_HPP_
+
+namespace dqn {
+namespace static_net {
+
+/**
+ * Layer kernels whose dimensions are all template parameters, so that the
+ * compiler can unroll and vectorize every loop. Data layouts follow Caffe:
+ * blobs are CHW, convolution weights are [out][in][kernel][kernel] and
+ * inner product weights are [out][in].
+ */
+
+// Dot product of two length N vectors. Keeps kLanes partial sums so that
+// the loop vectorizes without -ffast-math.
+template <int N>
+inline float Dot(const float* a, const float* b) {
+  constexpr int kLanes = 8;
+  constexpr int kBlocked = N / kLanes * kLanes;
+  float acc[kLanes] = {};
+  for (int i = 0; i < kBlocked; i += kLanes) {
+    for (int l = 0; l < kLanes; ++l) {
+      acc[l] += a[i + l] * b[i + l];
+    }
+  }
+  float sum = 0.0f;
+  for (int i = kBlocked; i < N; ++i) {
+    sum += a[i] * b[i];
+  }
+  for (int l = 0; l < kLanes; ++l) {
+    sum += acc[l];
+  }
+  return sum;
+}
+
+template <int N>
+inline void LeakyReLU(float* data, const float negative_slope) {
+  for (int i = 0; i < N; ++i) {
+    data[i] = data[i] > 0.0f ? data[i] : data[i] * negative_slope;
+  }
+}
+
+template <int InChannels, int InHeight, int InWidth, int OutChannels,
+          int Kernel, int Stride, int Pad>
+struct Convolution {
+  static constexpr int kOutHeight = (InHeight + 2 * Pad - Kernel) / Stride + 1;
+  static constexpr int kOutWidth = (InWidth + 2 * Pad - Kernel) / Stride + 1;
+  static constexpr int kOutputSize = OutChannels * kOutHeight * kOutWidth;
+
+  static void Forward(const float* input, const float* weight,
+                      const float* bias, float* output) {
+    for (int oc = 0; oc < OutChannels; ++oc) {
+      float* out = output + oc * kOutHeight * kOutWidth;
+      for (int i = 0; i < kOutHeight * kOutWidth; ++i) {
+        out[i] = bias[oc];
+      }
+      for (int ic = 0; ic < InChannels; ++ic) {
+        const float* in = input + ic * InHeight * InWidth;
+        const float* w = weight + (oc * InChannels + ic) * Kernel * Kernel;
+        for (int ky = 0; ky < Kernel; ++ky) {
+          for (int kx = 0; kx < Kernel; ++kx) {
+            const float wv = w[ky * Kernel + kx];
+            for (int oy = 0; oy < kOutHeight; ++oy) {
+              const int y = oy * Stride + ky - Pad;
+              if (Pad > 0 && (y < 0 || y >= InHeight)) continue;
+              for (int ox = 0; ox < kOutWidth; ++ox) {
+                const int x = ox * Stride + kx - Pad;
+                if (Pad > 0 && (x < 0 || x >= InWidth)) continue;
+                out[oy * kOutWidth + ox] += wv * in[y * InWidth + x];
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+};
+
+template <int InSize, int OutSize>
+struct InnerProduct {
+  static constexpr int kOutputSize = OutSize;
+
+  static void Forward(const float* input, const float* weight,
+                      const float* bias, float* output) {
+    for (int o = 0; o < OutSize; ++o) {
+      output[o] = bias[o] + Dot<InSize>(weight + o * InSize, input);
+    }
+  }
+};
+
+} // namespace static_net
+} // namespace dqn
+
+#endif /* STATIC_NET_HPP_ */
@@ -0,0 +1,107 @@
+#include "synthetic_environment.hpp"
+#include <algorithm>
+#include <cassert>
+
+namespace dqn {
+
+namespace {
+
+struct SyntheticState : public EnvironmentState {
+  uint64_t episode;
+  uint64_t random;
+  int frame;
+};
+
+}
+
+SyntheticEnvironment::SyntheticEnvironment(const int seed,
+                                           const int num_actions,
+                                           const int episode_frames,
+                                           const int frame_cost,
+                                           const int skip_frame,
+                                           const bool ram) :
+    seed_(seed),
+    num_actions_(num_actions),
+    episode_frames_(episode_frames),
+    frame_cost_(frame_cost),
+    skip_frame_(skip_frame),
+    ram_(ram),
+    episode_(0),
+    random_(0),
+    frame_(0) {
+  assert(num_actions > 0 && num_actions <= kOutputCount);
+  assert(episode_frames > 0);
+  assert(frame_cost >= 0);
+  Reset();
+}
+
+void SyntheticEnvironment::Reset() {
+  // Never zero, which xorshift would keep forever
+  random_ = (seed_ + 1) * 0x9E3779B97F4A7C15ull ^ ++episode_;
+  random_ = random_ == 0 ? 1 : random_;
+  frame_ = 0;
+}
+
+void SyntheticEnvironment::EmulateFrame() {
+  for (auto i = 0; i < std::max(frame_cost_, 1); ++i) {
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 7;
+    random_ ^= random_ << 17;
+  }
+  ++frame_;
+}
+
+double SyntheticEnvironment::Act(const Action action) {
+  const auto score = static_cast<int>(action) == Target() ? 1.0 : 0.0;
+  for (auto i = 0; i < skip_frame_ + 1 && !GameOver(); ++i) {
+    EmulateFrame();
+  }
+  return score;
+}
+
+FrameDataSp SyntheticEnvironment::Observe() {
+  auto frame = MakeFrameData(frame_data_size());
+  std::fill(frame->begin(), frame->end(), 0);
+  const auto target = Target();
+  if (ram_) {
+    (*frame)[0] = target;
+    (*frame)[1] = frame_ & 0xFF;
+    for (auto i = 2; i < frame->size(); ++i) {
+      (*frame)[i] = (random_ >> (8 * (i % 8))) & 0xFF;
+    }
+    return frame;
+  }
+  const auto begin = target * kCroppedFrameSize / num_actions_;
+  const auto end = (target + 1) * kCroppedFrameSize / num_actions_;
+  for (auto row = 0; row < kCroppedFrameSize; ++row) {
+    std::fill(frame->begin() + row * kCroppedFrameSize + begin,
+              frame->begin() + row * kCroppedFrameSize + end, 255);
+  }
+  return frame;
+}
+
+EnvironmentStateSp SyntheticEnvironment::CloneState() {
+  auto state = std::make_shared<SyntheticState>();
+  state->episode = episode_;
+  state->random = random_;
+  state->frame = frame_;
+  return state;
+}
+
+void SyntheticEnvironment::RestoreState(const EnvironmentState& state) {
+  assert(dynamic_cast<const SyntheticState*>(&state));
+  const auto& synthetic = static_cast<const SyntheticState&>(state);
+  episode_ = synthetic.episode;
+  random_ = synthetic.random;
+  frame_ = synthetic.frame;
+}
+
+ActionVect SyntheticEnvironment::MinimalActionSet() {
+  ActionVect actions;
+  for (auto i = 0; i < num_actions_; ++i) {
+    actions.push_back(static_cast<Action>(i));
+  }
+  return actions;
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef SYNTHETIC_ENVIRONMENT_HPP_
+#define SYNTHETIC_ENVIRONMENT_HPP_
+
+#include <cstdint>
+#include "environment.hpp"
+
+namespace dqn {
+
+/**
+ * A deterministic stand-in for a ROM, to benchmark and test the actor,
+ * learner and replay pipelines without ALE games.
+ *
+ * Each frame shows a target action as a vertical band (or as the first
+ * RAM byte), and an agent step earns 1 when it takes the target action.
+ * Episodes last episode_frames emulated frames. Emulating a frame costs
+ * frame_cost rounds (at least one) of a pseudo-random generator, which
+ * also picks the targets, so the cost of a real emulator can be mimicked.
+ * Episodes are the same for every environment built with the same seed.
+ */
+class SyntheticEnvironment : public Environment {
+public:
+  SyntheticEnvironment(const int seed,
+                       const int num_actions,
+                       const int episode_frames,
+                       const int frame_cost,
+                       const int skip_frame,
+                       const bool ram);
+
+  void Reset() override;
+
+  double Act(const Action action) override;
+
+  bool GameOver() const override { return frame_ >= episode_frames_; }
+
+  FrameDataSp Observe() override;
+
+  EnvironmentStateSp CloneState() override;
+
+  void RestoreState(const EnvironmentState& state) override;
+
+  // The generator is the whole state of the game
+  EnvironmentStateSp CloneSystemState() override { return CloneState(); }
+
+  void RestoreSystemState(const EnvironmentState& state) override {
+    RestoreState(state);
+  }
+
+  ActionVect MinimalActionSet() override;
+
+  int frame_data_size() const override {
+    return ram_ ? kRamSize : kCroppedFrameDataSize;
+  }
+
+  int frames_per_step() const override { return skip_frame_ + 1; }
+
+protected:
+  // Index of the action that currently earns a reward
+  int Target() const { return (random_ >> 32) % num_actions_; }
+
+  // Emulate one frame
+  void EmulateFrame();
+
+protected:
+  const uint64_t seed_;
+  const int num_actions_;
+  const int episode_frames_;
+  const int frame_cost_;
+  const int skip_frame_;
+  const bool ram_;
+  uint64_t episode_; // Number of resets
+  uint64_t random_; // State of the xorshift generator
+  int frame_; // Frames emulated in this episode
+};
+
+}
+
+#endif /* SYNTHETIC_ENVIRONMENT_HPP_ */
@@ -0,0 +1,145 @@
+#include "task_graph.hpp"
+#include <cassert>
+#include <sstream>
+
+namespace dqn {
+
+TaskGraph::TaskGraph(const std::shared_ptr<WorkerPool>& pool) :
+    pool_(pool),
+    remaining_(0) {}
+
+TaskGraph::Id TaskGraph::AddNode(Node node, const std::vector<Id>& after) {
+  seconds_.clear();
+  const Id id = nodes_.size();
+  node.unmet = after.size();
+  for (const auto dependency : after) {
+    assert(dependency >= 0 && dependency < id);
+    nodes_[dependency].dependents.push_back(id);
+  }
+  nodes_.push_back(std::move(node));
+  return id;
+}
+
+TaskGraph::Id TaskGraph::AddMain(const std::string& name,
+                                 const std::function<void()>& task,
+                                 const std::vector<Id>& after) {
+  Node node;
+  node.name = name;
+  node.main_task = task;
+  return AddNode(std::move(node), after);
+}
+
+TaskGraph::Id TaskGraph::AddParallel(const std::string& name,
+                                     const std::function<void(int)>& task,
+                                     const std::vector<int>& items,
+                                     const std::vector<Id>& after) {
+  const Id id = nodes_.size();
+  Node node;
+  node.name = name;
+  node.items = items;
+  node.batch.reset(new WorkerPool::Batch(task, [this, id]() {
+    std::vector<Id> ready;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ready = Finish(id);
+    }
+    Start(ready);
+  }));
+  return AddNode(std::move(node), after);
+}
+
+void TaskGraph::Start(const std::vector<Id>& ready) {
+  for (const auto id : ready) {
+    Node& node = nodes_[id];
+    node.start = std::chrono::steady_clock::now();
+    if (!node.batch) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ready_main_.insert(id);
+      main_ready_.notify_all();
+    } else if (!node.items.empty()) {
+      pool_->Issue(*node.batch, node.items);
+    } else {
+      // The pool never completes an empty batch
+      std::vector<Id> next;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        next = Finish(id);
+      }
+      Start(next);
+    }
+  }
+}
+
+std::vector<TaskGraph::Id> TaskGraph::Finish(const Id id) {
+  Node& node = nodes_[id];
+  node.seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - node.start).count();
+  auto& stage = profile_[node.name];
+  ++stage.calls;
+  stage.seconds += node.seconds;
+  std::vector<Id> ready;
+  for (const auto dependent : node.dependents) {
+    if (--nodes_[dependent].unmet == 0) {
+      ready.push_back(dependent);
+    }
+  }
+  if (--remaining_ == 0) {
+    main_ready_.notify_all();
+  }
+  return ready;
+}
+
+void TaskGraph::Run() {
+  std::vector<Id> ready;
+  for (auto id = 0; id < nodes_.size(); ++id) {
+    if (nodes_[id].unmet == 0) {
+      ready.push_back(id);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    remaining_ = nodes_.size();
+  }
+  Start(ready);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    main_ready_.wait(
+        lock, [&]{ return remaining_ == 0 || !ready_main_.empty(); });
+    if (ready_main_.empty()) {
+      break;
+    }
+    const auto id = *ready_main_.begin();
+    ready_main_.erase(ready_main_.begin());
+    lock.unlock();
+    nodes_[id].start = std::chrono::steady_clock::now();
+    nodes_[id].main_task();
+    lock.lock();
+    const auto next = Finish(id);
+    lock.unlock();
+    Start(next);
+    lock.lock();
+  }
+  lock.unlock();
+  // The workers no longer access the nodes once every task is done
+  seconds_.clear();
+  for (const auto& node : nodes_) {
+    seconds_.push_back(node.seconds);
+  }
+  nodes_.clear();
+}
+
+std::string TaskGraph::TakeProfile() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ostringstream profile;
+  profile << "Task profile:";
+  for (const auto& stage : profile_) {
+    profile << "\n  " << stage.first << ": " << stage.second.calls
+            << " calls, " << stage.second.seconds << " s, "
+            << 1000 * stage.second.seconds / stage.second.calls
+            << " ms per call";
+  }
+  profile_.clear();
+  return profile.str();
+}
+
+}
@@ -0,0 +1,96 @@
+#ifndef TASK_GRAPH_HPP_
+#define TASK_GRAPH_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "worker_pool.hpp"
+
+namespace dqn {
+
+/**
+ * A graph of named tasks and their dependencies, run once by Run().
+ *
+ * Main tasks run one at a time on the thread calling Run(), which is where
+ * the nets live. Parallel tasks run on each of their items on the threads
+ * of a WorkerPool, shared with the VecEnvs. A task starts as soon as the
+ * tasks it comes after are done, so independent tasks overlap; among the
+ * ready main tasks, the first one added runs first.
+ *
+ * The time of every task is accumulated per name, so the graph is the one
+ * place where the stages of a loop are measured.
+ */
+class TaskGraph {
+public:
+  using Id = int;
+
+  explicit TaskGraph(const std::shared_ptr<WorkerPool>& pool);
+
+  // Add a task run on the thread calling Run()
+  Id AddMain(const std::string& name,
+             const std::function<void()>& task,
+             const std::vector<Id>& after);
+
+  // Add a task run on the workers, once per item
+  Id AddParallel(const std::string& name,
+                 const std::function<void(int)>& task,
+                 const std::vector<int>& items,
+                 const std::vector<Id>& after);
+
+  // Run the tasks added since the last call and remove them
+  void Run();
+
+  // Seconds spent by a task of the last Run(), until a task is added
+  double seconds(const Id id) const { return seconds_[id]; }
+
+  // Calls and seconds spent by each task name since the last call. The
+  // time of a parallel task is the time until its last item is done.
+  std::string TakeProfile();
+
+protected:
+  struct Node {
+    std::string name;
+    std::function<void()> main_task; // Empty for parallel tasks
+    std::unique_ptr<WorkerPool::Batch> batch; // Parallel tasks only
+    std::vector<int> items;
+    std::vector<Id> dependents;
+    int unmet; // Dependencies not done yet
+    std::chrono::steady_clock::time_point start;
+    double seconds;
+  };
+
+  struct Stage {
+    int calls;
+    double seconds;
+  };
+
+  Id AddNode(Node node, const std::vector<Id>& after);
+
+  // Start the parallel tasks of ready, or queue them if they are main
+  // tasks. Called without the lock held.
+  void Start(const std::vector<Id>& ready);
+
+  // Record the end of a task, returning the tasks it made ready. Called
+  // with the lock held.
+  std::vector<Id> Finish(const Id id);
+
+protected:
+  const std::shared_ptr<WorkerPool> pool_;
+  std::vector<Node> nodes_;
+  std::vector<double> seconds_; // Of the tasks of the last Run()
+  std::mutex mutex_; // Guards the members below
+  std::condition_variable main_ready_;
+  std::set<Id> ready_main_; // Main tasks ready to run
+  int remaining_; // Tasks of the current Run() not done yet
+  std::map<std::string, Stage> profile_;
+};
+
+}
+
+#endif /* TASK_GRAPH_HPP_ */
@@ -0,0 +1,307 @@
+#include "vec_env.hpp"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iterator>
+#include <glog/logging.h>
+
+namespace dqn {
+
+VecEnv::VecEnv(std::vector<std::unique_ptr<Environment>> envs,
+               const std::shared_ptr<WorkerPool>& pool) :
+    envs_(std::move(envs)),
+    frames_per_step_(envs_.front()->frames_per_step()),
+    frame_data_size_(envs_.front()->frame_data_size()),
+    frame_buffer_(num_envs() * 2 * kInputFrameCount * frame_data_size_),
+    heads_(num_envs(), 0),
+    input_frames_(num_envs()),
+    random_engines_(num_envs()),
+    actions_(num_envs(), PLAYER_A_NOOP),
+    rewards_(num_envs(), 0),
+    terminals_(num_envs(), false),
+    scores_(num_envs(), 0),
+    episode_frames_(num_envs(), 0),
+    max_episode_frames_(0),
+    episode_scores_(num_envs(), 0),
+    emulated_frames_(0),
+    step_seconds_(0),
+    stepping_(false),
+    speculating_(false),
+    commands_(num_envs(), kNone),
+    speculations_(num_envs()),
+    speculation_hits_(num_envs(), 0),
+    speculation_misses_(num_envs(), 0),
+    random_steps_(0),
+    random_transitions_(num_envs()),
+    pool_(pool),
+    batch_([this](const int env) { RunCommand(env); }) {
+  for (auto i = 0; i < num_envs(); ++i) {
+    assert(envs_[i]->frame_data_size() == frame_data_size_);
+    random_engines_[i].seed(i);
+    speculations_[i].pending = false;
+    created_states_.push_back(envs_[i]->CloneSystemState());
+  }
+}
+
+VecEnv::~VecEnv() {
+  pool_->Wait(batch_);
+}
+
+void VecEnv::RunCommand(const int env) {
+  if (commands_[env] == kReset) {
+    ResetEnv(env);
+  } else if (commands_[env] == kStep) {
+    StepEnv(env);
+  } else if (commands_[env] == kSpeculate) {
+    SpeculateEnv(env);
+  } else {
+    PlayRandomlyEnv(env);
+  }
+}
+
+void VecEnv::IssueCommands(const std::vector<int>& envs,
+                           const Command command) {
+  // Issuing publishes the commands to the workers
+  for (const auto env : envs) {
+    commands_[env] = command;
+  }
+  pool_->Issue(batch_, envs);
+}
+
+void VecEnv::Wait() {
+  const auto wait_start = std::chrono::steady_clock::now();
+  pool_->Wait(batch_);
+  if (stepping_) {
+    step_seconds_ += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - step_start_).count();
+    stepping_ = false;
+  } else if (speculating_) {
+    // Only the wait delays the caller: the rest overlapped its work
+    step_seconds_ += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - wait_start).count();
+    speculating_ = false;
+  }
+}
+
+void VecEnv::Reset(const std::vector<int>& envs) {
+  IssueCommands(envs, kReset);
+  Wait();
+}
+
+void VecEnv::Step(const std::vector<int>& envs, const ActionVect& actions) {
+  StepAsync(envs, actions);
+  Wait();
+}
+
+void VecEnv::StepAsync(const std::vector<int>& envs,
+                       const ActionVect& actions) {
+  assert(envs.size() == actions.size());
+  for (auto i = 0; i < envs.size(); ++i) {
+    actions_[envs[i]] = actions[i];
+  }
+  step_start_ = std::chrono::steady_clock::now();
+  stepping_ = true;
+  IssueCommands(envs, kStep);
+  emulated_frames_ += envs.size() * frames_per_step_;
+}
+
+void VecEnv::SpeculateAsync(const std::vector<int>& envs) {
+  speculating_ = true;
+  IssueCommands(envs, kSpeculate);
+}
+
+void VecEnv::StepOn(const int env, const Action action) {
+  actions_[env] = action;
+  StepEnv(env);
+}
+
+void VecEnv::ResetOn(const int env) {
+  ResetEnv(env);
+}
+
+void VecEnv::CountSteps(const int num_steps, const double seconds) {
+  emulated_frames_ += num_steps * frames_per_step_;
+  step_seconds_ += seconds;
+}
+
+std::vector<Transition> VecEnv::PlayRandomly(const int steps) {
+  assert(steps >= 0);
+  std::vector<int> envs(num_envs());
+  for (auto i = 0; i < num_envs(); ++i) {
+    envs[i] = i;
+  }
+  random_steps_ = steps;
+  IssueCommands(envs, kPlayRandomly);
+  Wait();
+  std::vector<Transition> transitions;
+  for (auto& env_transitions : random_transitions_) {
+    std::move(env_transitions.begin(), env_transitions.end(),
+              std::back_inserter(transitions));
+    env_transitions.clear();
+  }
+  return transitions;
+}
+
+double VecEnv::TakeSpeculationHitRate() {
+  int hits = 0;
+  int misses = 0;
+  for (auto i = 0; i < num_envs(); ++i) {
+    hits += speculation_hits_[i];
+    misses += speculation_misses_[i];
+    speculation_hits_[i] = 0;
+    speculation_misses_[i] = 0;
+  }
+  return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0;
+}
+
+double VecEnv::TakeFramesPerSecond() {
+  const auto fps = step_seconds_ > 0 ? emulated_frames_ / step_seconds_ : 0;
+  emulated_frames_ = 0;
+  step_seconds_ = 0;
+  return fps;
+}
+
+void VecEnv::PushFrame(const int env, const FrameDataSp& frame) {
+  assert(frame->size() == frame_data_size_);
+  auto& head = heads_[env];
+  const auto ring = frame_buffer_.begin() +
+      env * 2 * kInputFrameCount * frame_data_size_;
+  std::copy(frame->begin(), frame->end(), ring + head * frame_data_size_);
+  std::copy(frame->begin(), frame->end(),
+            ring + (head + kInputFrameCount) * frame_data_size_);
+  head = (head + 1) % kInputFrameCount;
+  auto& input_frames = input_frames_[env];
+  std::move(input_frames.begin() + 1, input_frames.end(),
+            input_frames.begin());
+  input_frames.back() = frame;
+}
+
+VecEnv::StartState VecEnv::WarmUp(Environment& environment,
+                                  const int noops) {
+  StartState start;
+  while (start.frames.size() < kInputFrameCount) {
+    if (start.frames.empty()) {
+      environment.Reset();
+      start.score = 0;
+      for (auto i = 0; i < noops && !environment.GameOver(); ++i) {
+        start.score += environment.Act(PLAYER_A_NOOP);
+      }
+    } else {
+      // Until there are enough frames for DQN input, just select NOOP
+      start.score += environment.Act(PLAYER_A_NOOP);
+    }
+    if (environment.GameOver()) {
+      start.frames.clear();
+      continue;
+    }
+    start.frames.push_back(environment.Observe());
+  }
+  return start;
+}
+
+void VecEnv::CacheStartStates(const int num_states, const int max_noops) {
+  assert(num_states >= 0 && max_noops >= 0);
+  Wait();
+  // Environment 0 captures the states, so it must be
+  // reset before its next episode, like every new environment
+  std::mt19937 random_engine(0);
+  start_states_.clear();
+  for (auto i = 0; i < num_states; ++i) {
+    const auto noops =
+        std::uniform_int_distribution<int>(0, max_noops)(random_engine);
+    start_states_.push_back(WarmUp(*envs_[0], noops));
+    start_states_.back().state = envs_[0]->CloneState();
+  }
+  LOG_IF(INFO, num_states > 0) << "Cached " << num_states
+                               << " start states";
+}
+
+void VecEnv::Rewind() {
+  Wait();
+  for (auto i = 0; i < num_envs(); ++i) {
+    envs_[i]->RestoreSystemState(*created_states_[i]);
+    random_engines_[i].seed(i);
+    speculations_[i].pending = false;
+  }
+}
+
+void VecEnv::ResetEnv(const int env) {
+  speculations_[env].pending = false;
+  episode_frames_[env] = 0;
+  if (start_states_.empty()) {
+    const auto start = WarmUp(*envs_[env], 0);
+    scores_[env] = start.score;
+    for (const auto& frame : start.frames) {
+      PushFrame(env, frame);
+    }
+    return;
+  }
+  const auto& start = start_states_[std::uniform_int_distribution<int>(
+      0, start_states_.size() - 1)(random_engines_[env])];
+  envs_[env]->RestoreState(*start.state);
+  scores_[env] = start.score;
+  for (const auto& frame : start.frames) {
+    PushFrame(env, frame);
+  }
+}
+
+void VecEnv::SpeculateEnv(const int env) {
+  Environment& environment = *envs_[env];
+  auto& speculation = speculations_[env];
+  speculation.pending = true;
+  speculation.action = actions_[env];
+  speculation.state = environment.CloneState();
+  speculation.score = environment.Act(speculation.action);
+  speculation.game_over = environment.GameOver();
+  speculation.frame = speculation.game_over ? nullptr : environment.Observe();
+}
+
+void VecEnv::PlayRandomlyEnv(const int env) {
+  const auto legal_actions = envs_[env]->MinimalActionSet();
+  std::uniform_int_distribution<int> random_action(0, legal_actions.size() - 1);
+  auto& transitions = random_transitions_[env];
+  for (auto i = 0; i < random_steps_; ++i) {
+    const auto past_frames = input_frames_[env];
+    actions_[env] = legal_actions[random_action(random_engines_[env])];
+    StepEnv(env);
+    transitions.push_back(terminals_[env] ?
+        Transition(past_frames, actions_[env], rewards_[env], boost::none) :
+        Transition(past_frames, actions_[env], rewards_[env],
+                   input_frames_[env][kInputFrameCount - 1]));
+  }
+}
+
+void VecEnv::StepEnv(const int env) {
+  Environment& environment = *envs_[env];
+  auto& speculation = speculations_[env];
+  const auto hit = speculation.pending &&
+      speculation.action == actions_[env];
+  if (speculation.pending) {
+    ++(hit ? speculation_hits_ : speculation_misses_)[env];
+    speculation.pending = false;
+    if (!hit) {
+      environment.RestoreState(*speculation.state);
+    }
+  }
+  const auto immediate_score = hit ? speculation.score :
+      environment.Act(actions_[env]);
+  const auto game_over = hit ? speculation.game_over : environment.GameOver();
+  scores_[env] += immediate_score;
+  episode_frames_[env] += frames_per_step_;
+  // Rewards for DQN are normalized as follows:
+  // 1 for any positive score, -1 for any negative score, otherwise 0
+  rewards_[env] = immediate_score == 0 ? 0 : immediate_score /
+      std::abs(immediate_score);
+  assert(rewards_[env] <= 1 && rewards_[env] >= -1);
+  terminals_[env] = game_over || (max_episode_frames_ > 0 &&
+      episode_frames_[env] >= max_episode_frames_);
+  if (terminals_[env]) {
+    episode_scores_[env] = scores_[env];
+    ResetEnv(env);
+  } else {
+    PushFrame(env, hit ? speculation.frame : environment.Observe());
+  }
+}
+
+}
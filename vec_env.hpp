@@ -0,0 +1,212 @@
+#ifndef VEC_ENV_HPP_
+#define VEC_ENV_HPP_
+
+#include <cassert>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+#include "dqn.hpp"
+#include "environment.hpp"
+#include "worker_pool.hpp"
+
+namespace dqn {
+
+/**
+ * A vector of M environments stepped together by the N threads of a
+ * WorkerPool, which several VecEnvs may share. Work stealing keeps the
+ * load balanced when step costs vary.
+ *
+ * The last kInputFrameCount frames of every environment are kept in a
+ * contiguous buffer, as a ring of 2 * kInputFrameCount frame slots per
+ * environment. Each frame is written to two slots kInputFrameCount apart,
+ * so the stacked frames of an environment are always one contiguous
+ * window, in order, that can be copied straight into the net input.
+ *
+ * An environment whose episode ends is reset immediately, and its frames
+ * are those of the new episode.
+ */
+class VecEnv {
+public:
+  // All environments must observe frames of the same size
+  VecEnv(std::vector<std::unique_ptr<Environment>> envs,
+         const std::shared_ptr<WorkerPool>& pool);
+
+  ~VecEnv();
+
+  // Start a new episode on the given environments
+  void Reset(const std::vector<int>& envs);
+
+  // Take actions[i] on environment envs[i] for one agent step.
+  // Environments whose episode ends are reset.
+  void Step(const std::vector<int>& envs, const ActionVect& actions);
+
+  // Same as Step() but return right away. Until Wait() returns, only the
+  // other environments may be accessed, and no other command issued.
+  void StepAsync(const std::vector<int>& envs, const ActionVect& actions);
+
+  // Wait for the command issued by StepAsync() or SpeculateAsync() to
+  // complete
+  void Wait();
+
+  // Speculatively step the given environments with their previous action
+  // without waiting, keeping their emulator state. The frames, rewards and
+  // terminals stay those of the last step, so they may be read meanwhile,
+  // but no other command may be issued until Wait() returns. The next
+  // Step() commits the speculation of an environment whose action matches
+  // and restores the kept state of the others before stepping them.
+  void SpeculateAsync(const std::vector<int>& envs);
+
+  // Play uniformly random actions on every environment for steps steps
+  // each, in a single command, and return the transitions. Episodes that
+  // end are reset as by Step().
+  std::vector<Transition> PlayRandomly(const int steps);
+
+  // Take action on environment env for one step on the calling thread, as
+  // Step() does on a worker. Different environments may be stepped by
+  // different threads at once, while no command is in flight.
+  void StepOn(const int env, const Action action);
+
+  // Start a new episode on environment env on the calling thread, as
+  // Reset() does on a worker
+  void ResetOn(const int env);
+
+  // Count num_steps steps taken by StepOn() in seconds in the frames per
+  // second
+  void CountSteps(const int num_steps, const double seconds);
+
+  // Fraction of the speculations committed since the last call
+  double TakeSpeculationHitRate();
+
+  // Capture num_states emulator states right after a reset and a random
+  // number of NOOP steps, up to max_noops, followed by the warm-up frames.
+  // Later resets restore one of them at random instead of replaying the
+  // start of the game. 0 states goes back to plain resets.
+  void CacheStartStates(const int num_states, const int max_noops);
+
+  // Bring every environment back to the state it was created in,
+  // including the random number generators of its emulator and of its
+  // start states, so the same actions replay the same games. The
+  // environments must be reset before they are stepped again.
+  void Rewind();
+
+  int num_envs() const { return envs_.size(); }
+
+  int frame_data_size() const { return frame_data_size_; }
+
+  int frames_per_step() const { return frames_per_step_; }
+
+  // End episodes after max_episode_frames emulated frames, as if the game
+  // were over. 0 lets episodes run until game over.
+  void set_max_episode_frames(const int max_episode_frames) {
+    assert(max_episode_frames >= 0);
+    max_episode_frames_ = max_episode_frames;
+  }
+
+  // Frames emulated per second of Step() since the last call. The time
+  // spent waiting for speculative steps counts as stepping time.
+  double TakeFramesPerSecond();
+
+  // The kInputFrameCount stacked frames of an environment, as one
+  // contiguous window of the frame buffer
+  const uint8_t* frames(const int env) const {
+    return frame_buffer_.data() +
+        (env * 2 * kInputFrameCount + heads_[env]) * frame_data_size_;
+  }
+
+  // The same frames, shared with replay memory
+  const InputFrames& input_frames(const int env) const {
+    return input_frames_[env];
+  }
+
+  // Normalized reward of the last step: -1, 0 or 1
+  float reward(const int env) const { return rewards_[env]; }
+
+  // Whether the last step ended an episode, by game over or frame cap
+  bool terminal(const int env) const { return terminals_[env]; }
+
+  // Score of the episode ended by the last step
+  double episode_score(const int env) const { return episode_scores_[env]; }
+
+  Environment& environment(const int env) { return *envs_[env]; }
+
+  const std::shared_ptr<WorkerPool>& pool() const { return pool_; }
+
+protected:
+  enum Command { kNone, kReset, kStep, kSpeculate, kPlayRandomly };
+
+  // An episode start: the emulator state once the first kInputFrameCount
+  // frames are observed, those frames and the score so far
+  struct StartState {
+    EnvironmentStateSp state;
+    std::vector<FrameDataSp> frames;
+    double score;
+  };
+
+  // The outcome of a speculative step, to commit or roll back
+  struct Speculation {
+    bool pending;
+    Action action;
+    EnvironmentStateSp state; // Before the step
+    double score;
+    bool game_over;
+    FrameDataSp frame; // Empty if the game is over
+  };
+
+  // Run the command of env, on a worker thread
+  void RunCommand(const int env);
+
+  // Run the given command on each environment without waiting
+  void IssueCommands(const std::vector<int>& envs, const Command command);
+
+  void ResetEnv(const int env);
+
+  void StepEnv(const int env);
+
+  void SpeculateEnv(const int env);
+
+  void PlayRandomlyEnv(const int env);
+
+  // Push a frame of env into its ring
+  void PushFrame(const int env, const FrameDataSp& frame);
+
+  // Reset the game, take noops NOOP steps and observe kInputFrameCount
+  // frames, restarting if the game ends meanwhile. The returned state is
+  // left empty.
+  StartState WarmUp(Environment& environment, const int noops);
+
+protected:
+  const std::vector<std::unique_ptr<Environment>> envs_;
+  const int frames_per_step_;
+  const int frame_data_size_;
+  std::vector<uint8_t> frame_buffer_;
+  std::vector<int> heads_; // Ring slot of the oldest frame
+  std::vector<InputFrames> input_frames_;
+  std::vector<std::mt19937> random_engines_; // Pick start states
+  std::vector<EnvironmentStateSp> created_states_; // For Rewind()
+  std::vector<StartState> start_states_;
+  std::vector<Action> actions_;
+  std::vector<float> rewards_;
+  std::vector<char> terminals_; // Not vector<bool>: written concurrently
+  std::vector<double> scores_; // Score of the current episodes
+  std::vector<int> episode_frames_; // Frames of the current episodes
+  int max_episode_frames_;
+  std::vector<double> episode_scores_;
+  long emulated_frames_;
+  double step_seconds_;
+  std::chrono::steady_clock::time_point step_start_;
+  bool stepping_; // Whether the command in flight is a step
+  bool speculating_; // Whether the command in flight is a speculation
+  std::vector<Command> commands_; // Written before envs are issued
+  std::vector<Speculation> speculations_;
+  std::vector<int> speculation_hits_;
+  std::vector<int> speculation_misses_;
+  int random_steps_; // Steps of each environment in PlayRandomly()
+  std::vector<std::vector<Transition>> random_transitions_;
+  const std::shared_ptr<WorkerPool> pool_;
+  WorkerPool::Batch batch_;
+};
+
+}
+
+#endif /* VEC_ENV_HPP_ */
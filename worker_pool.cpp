@@ -0,0 +1,111 @@
+#include "worker_pool.hpp"
+#include <cassert>
+#include <string>
+#include "cpu_budget.hpp"
+
+namespace dqn {
+
+WorkerPool::WorkerPool(const int num_threads) :
+    unclaimed_tasks_(0),
+    next_queue_(0),
+    stopping_(false) {
+  assert(num_threads > 0);
+  for (auto i = 0; i < num_threads; ++i) {
+    queues_.emplace_back(new WorkQueue());
+  }
+  for (auto i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(&WorkerPool::Run, this, i);
+    NameThread(threads_.back().native_handle(),
+               "dqn_worker_" + std::to_string(i));
+  }
+}
+
+void WorkerPool::Pin(const std::vector<int>& cpus) {
+  for (auto i = 0; i < num_threads(); ++i) {
+    PinThread(threads_[i].native_handle(), {cpus[i % cpus.size()]});
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  tasks_queued_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void WorkerPool::Issue(Batch& batch, const std::vector<int>& items) {
+  if (items.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  assert(batch.pending_ == 0);
+  batch.pending_ = items.size();
+  for (const auto item : items) {
+    WorkQueue& queue = *queues_[next_queue_];
+    next_queue_ = (next_queue_ + 1) % queues_.size();
+    std::lock_guard<std::mutex> queue_lock(queue.mutex);
+    queue.tasks.push_back(Task{&batch, item});
+  }
+  unclaimed_tasks_ += items.size();
+  tasks_queued_.notify_all();
+}
+
+void WorkerPool::Wait(Batch& batch) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  batch.done_.wait(lock, [&]{ return batch.pending_ == 0; });
+}
+
+void WorkerPool::Run(const int worker) {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      tasks_queued_.wait(
+          lock, [&]{ return stopping_ || unclaimed_tasks_ > 0; });
+      if (stopping_) {
+        return;
+      }
+      --unclaimed_tasks_;
+    }
+    const auto task = TakeTask(worker);
+    task.batch->task_(task.item);
+    std::function<void()> on_done;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--task.batch->pending_ == 0) {
+        // The batch may be destroyed once its waiter wakes up
+        on_done = task.batch->on_done_;
+        task.batch->done_.notify_all();
+      }
+    }
+    if (on_done) {
+      on_done();
+    }
+  }
+}
+
+WorkerPool::Task WorkerPool::TakeTask(const int worker) {
+  // There are at least as many queued tasks as workers that claimed one,
+  // so the scan ends even if others steal the task seen first
+  for (auto i = 0; ; i = (i + 1) % queues_.size()) {
+    WorkQueue& queue = *queues_[(worker + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      continue;
+    }
+    Task task;
+    if (i == 0) {
+      task = queue.tasks.front();
+      queue.tasks.pop_front();
+    } else {
+      task = queue.tasks.back();
+      queue.tasks.pop_back();
+    }
+    return task;
+  }
+}
+
+}
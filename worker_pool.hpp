@@ -0,0 +1,89 @@
+#ifndef WORKER_POOL_HPP_
+#define WORKER_POOL_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dqn {
+
+/**
+ * A pool of worker threads shared by every VecEnv of the process.
+ *
+ * Work is issued in batches: a task and the items to run it on. Each
+ * worker has a queue of items; the items of a batch are dealt
+ * round-robin to the queues, a worker takes work from the front of its
+ * own queue and, once it is empty, steals from the back of the others.
+ * Batches from several owners may be in flight at once and share the
+ * workers in the order they were issued.
+ */
+class WorkerPool {
+public:
+  // A task run on a set of items, issued and waited for together. A batch
+  // may be issued again once its items are done. If given, on_done is
+  // called by the worker finishing the last item, after which the batch is
+  // no longer accessed by the pool.
+  class Batch {
+  public:
+    explicit Batch(const std::function<void(int)>& task,
+                   const std::function<void()>& on_done = nullptr) :
+        task_(task), on_done_(on_done), pending_(0) {}
+
+  private:
+    friend class WorkerPool;
+    const std::function<void(int)> task_;
+    const std::function<void()> on_done_;
+    int pending_; // Items not done yet
+    std::condition_variable done_;
+  };
+
+  explicit WorkerPool(const int num_threads);
+
+  ~WorkerPool();
+
+  // Start running the task of batch on each item and return right away
+  void Issue(Batch& batch, const std::vector<int>& items);
+
+  // Wait until every item of batch is done
+  void Wait(Batch& batch);
+
+  // Pin worker i to CPU cpus[i % cpus.size()]
+  void Pin(const std::vector<int>& cpus);
+
+  int num_threads() const { return threads_.size(); }
+
+protected:
+  struct Task {
+    Batch* batch;
+    int item;
+  };
+
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // Main method of the worker threads
+  void Run(const int worker);
+
+  // Take a task from the queue of worker, or steal one from another queue.
+  // The caller must have claimed a queued task.
+  Task TakeTask(const int worker);
+
+protected:
+  std::vector<std::unique_ptr<WorkQueue>> queues_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_; // Guards the members below and the batches
+  std::condition_variable tasks_queued_;
+  int unclaimed_tasks_; // Queued tasks no worker has claimed yet
+  int next_queue_; // Queue of the next item to deal
+  bool stopping_;
+};
+
+}
+
+#endif /* WORKER_POOL_HPP_ */